@@ -0,0 +1,14 @@
+/**
+ * @file messageQueueUser.c
+ * @author Alexandru Blinda
+ * @date 6 November 2017
+ * @version 0.1
+ * @brief Builds messageQueue.c as a user space library on top of queueShim.h.
+ */
+#include "queueShim.h"
+
+unsigned long queue_allocations;
+struct queue_counters queue_counters;
+struct latency_histogram residency_histogram;
+
+#include "../messageQueue.c"
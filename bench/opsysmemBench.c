@@ -0,0 +1,498 @@
+/**
+ * @file opsysmemBench.c
+ * @author Alexandru Blinda
+ * @date 6 November 2017
+ * @version 0.1
+ * @brief User space benchmark for /dev/opsysmem.
+ * Starts producer and consumer threads on the device for a fixed time and
+ * reports throughput and write-to-read latency percentiles as CSV or JSON,
+ * one row per run, so runs can be compared against each other.
+ * Build with 'make bench'.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "charDeviceDriverIoctl.h"
+
+#define DEFAULT_DEVICE "/dev/opsysmem"
+#define HEADER_SIZE 17 /* "%016llx" timestamp followed by ':' */
+#define MAX_LATENCY_SAMPLES 1000000 /* Per consumer; later samples replace random earlier ones */
+#define STOP_MARKER '!' /* First byte of the message telling a consumer to stop */
+
+enum size_distribution { SIZE_FIXED, SIZE_UNIFORM, SIZE_ZIPF };
+
+/* Options of one run */
+struct bench_options {
+
+    const char* device;
+    const char* label;
+    int producers;
+    int consumers;
+    double seconds;
+    int blocking; /* 1 if the blocking driver is loaded, so EAGAIN is an error */
+    int json;
+    int header;
+    enum size_distribution distribution;
+    unsigned long min_size;
+    unsigned long max_size;
+    double zipf_exponent;
+};
+
+/* Per thread results, merged at the end */
+struct bench_thread {
+
+    pthread_t thread;
+    int id;
+    unsigned long long seed;
+    unsigned long long messages;
+    unsigned long long bytes;
+    unsigned long long retries; /* EAGAIN answers that were retried */
+    unsigned long long errors;
+    unsigned long long* latencies; /* Nanoseconds, consumers only */
+    unsigned long latency_count;
+    unsigned long long latency_seen;
+};
+
+static struct bench_options options;
+static double* zipf_cdf; /* Cumulative weights of sizes min_size..max_size */
+static volatile int stop_producers;
+static pthread_barrier_t start_barrier;
+
+static unsigned long long now_ns(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift64*, one state per thread */
+static unsigned long long next_random(unsigned long long* state) {
+
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+static double next_uniform(unsigned long long* state) {
+
+    return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Builds the table used to draw Zipf distributed sizes; smaller sizes are more likely */
+static int build_zipf_table(void) {
+
+    unsigned long count = options.max_size - options.min_size + 1;
+    zipf_cdf = malloc(count * sizeof(double));
+    if(zipf_cdf == NULL) {
+
+        return -1;
+    }
+
+    double total = 0;
+    unsigned long i;
+    for(i = 0; i < count; i++) {
+
+        total += 1.0 / pow(i + 1, options.zipf_exponent);
+        zipf_cdf[i] = total;
+    }
+    return 0;
+}
+
+static unsigned long next_size(unsigned long long* state) {
+
+    unsigned long count = options.max_size - options.min_size + 1;
+    if(options.distribution == SIZE_FIXED) {
+
+        return options.min_size;
+    }
+    if(options.distribution == SIZE_UNIFORM) {
+
+        return options.min_size + next_random(state) % count;
+    }
+
+    /* Binary search for the first cumulative weight above the drawn one */
+    double target = next_uniform(state) * zipf_cdf[count - 1];
+    unsigned long low = 0, high = count - 1;
+    while(low < high) {
+
+        unsigned long middle = low + (high - low) / 2;
+        if(zipf_cdf[middle] < target) {
+
+            low = middle + 1;
+        } else {
+
+            high = middle;
+        }
+    }
+    return options.min_size + low;
+}
+
+/*
+ * Writes one message, retrying on EAGAIN when the non-blocking driver is loaded.
+ * Returns 0 on success.
+ */
+static int write_message(int fd, char* message, unsigned long size, struct bench_thread* self) {
+
+    for(;;) {
+
+        ssize_t written = write(fd, message, size);
+        if(written == (ssize_t) size) {
+
+            return 0;
+        }
+        if(written < 0 && errno == EAGAIN && !options.blocking) {
+
+            self->retries++;
+            sched_yield();
+            continue;
+        }
+        self->errors++;
+        return -1;
+    }
+}
+
+static void* producer(void* arg) {
+
+    struct bench_thread* self = arg;
+    char* message = malloc(options.max_size);
+    int fd = open(options.device, O_WRONLY);
+    if(message == NULL || fd < 0) {
+
+        perror("producer");
+        self->errors++;
+        pthread_barrier_wait(&start_barrier);
+        free(message);
+        return NULL;
+    }
+
+    /* The driver stops reading at the first null byte, so the payload has none */
+    memset(message, 'a' + self->id % 26, options.max_size);
+    pthread_barrier_wait(&start_barrier);
+
+    while(!stop_producers) {
+
+        unsigned long size = next_size(&self->seed);
+        char stamp[HEADER_SIZE + 1];
+        snprintf(stamp, sizeof(stamp), "%016llx:", now_ns());
+        memcpy(message, stamp, HEADER_SIZE);
+
+        if(write_message(fd, message, size, self) != 0) {
+
+            break;
+        }
+        self->messages++;
+        self->bytes += size;
+    }
+
+    close(fd);
+    free(message);
+    return NULL;
+}
+
+/* Keeps at most MAX_LATENCY_SAMPLES with reservoir sampling */
+static void record_latency(struct bench_thread* self, unsigned long long latency) {
+
+    self->latency_seen++;
+    if(self->latency_count < MAX_LATENCY_SAMPLES) {
+
+        self->latencies[self->latency_count++] = latency;
+        return;
+    }
+    unsigned long long slot = next_random(&self->seed) % self->latency_seen;
+    if(slot < MAX_LATENCY_SAMPLES) {
+
+        self->latencies[slot] = latency;
+    }
+}
+
+static void* consumer(void* arg) {
+
+    struct bench_thread* self = arg;
+    char* message = malloc(options.max_size + 1);
+    self->latencies = malloc(MAX_LATENCY_SAMPLES * sizeof(unsigned long long));
+    int fd = open(options.device, O_RDONLY);
+    if(message == NULL || self->latencies == NULL || fd < 0) {
+
+        perror("consumer");
+        self->errors++;
+        pthread_barrier_wait(&start_barrier);
+        free(message);
+        return NULL;
+    }
+    pthread_barrier_wait(&start_barrier);
+
+    for(;;) {
+
+        ssize_t size = read(fd, message, options.max_size);
+        if(size < 0) {
+
+            if(errno == EAGAIN && !options.blocking) {
+
+                self->retries++;
+                sched_yield();
+                continue;
+            }
+            self->errors++;
+            break;
+        }
+        if(size > 0 && message[0] == STOP_MARKER) {
+
+            break;
+        }
+        if(size < HEADER_SIZE) {
+
+            self->errors++;
+            continue;
+        }
+
+        unsigned long long read_time = now_ns();
+        message[HEADER_SIZE - 1] = '\0';
+        record_latency(self, read_time - strtoull(message, NULL, 16));
+        self->messages++;
+        self->bytes += size;
+    }
+
+    close(fd);
+    free(message);
+    return NULL;
+}
+
+static int compare_latencies(const void* a, const void* b) {
+
+    unsigned long long x = *(const unsigned long long*) a, y = *(const unsigned long long*) b;
+    return (x > y) - (x < y);
+}
+
+static unsigned long long percentile(unsigned long long* sorted, unsigned long count, double fraction) {
+
+    if(count == 0) {
+
+        return 0;
+    }
+    unsigned long index = (unsigned long) ceil(fraction * count);
+    if(index > 0) {
+
+        index--;
+    }
+    return sorted[index < count ? index : count - 1];
+}
+
+static const char* distribution_name(void) {
+
+    switch(options.distribution) {
+
+        case SIZE_UNIFORM:
+            return "uniform";
+        case SIZE_ZIPF:
+            return "zipf";
+        default:
+            return "fixed";
+    }
+}
+
+/* Parses fixed:N, uniform:MIN:MAX or zipf:MIN:MAX[:S] */
+static int parse_sizes(const char* text) {
+
+    options.zipf_exponent = 1.0;
+    if(sscanf(text, "fixed:%lu", &options.min_size) == 1) {
+
+        options.distribution = SIZE_FIXED;
+        options.max_size = options.min_size;
+    } else if(sscanf(text, "uniform:%lu:%lu", &options.min_size, &options.max_size) == 2) {
+
+        options.distribution = SIZE_UNIFORM;
+    } else if(sscanf(text, "zipf:%lu:%lu:%lf", &options.min_size, &options.max_size, &options.zipf_exponent) >= 2) {
+
+        options.distribution = SIZE_ZIPF;
+    } else {
+
+        return -1;
+    }
+
+    if(options.min_size < HEADER_SIZE || options.max_size < options.min_size) {
+
+        fprintf(stderr, "sizes must satisfy %d <= min <= max\n", HEADER_SIZE);
+        return -1;
+    }
+    return 0;
+}
+
+static void usage(const char* name) {
+
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -d device     device to use (default " DEFAULT_DEVICE ")\n"
+            "  -p producers  producer threads (default 1)\n"
+            "  -c consumers  consumer threads (default 1)\n"
+            "  -t seconds    time producers keep writing (default 5)\n"
+            "  -s sizes      fixed:N, uniform:MIN:MAX or zipf:MIN:MAX[:S] (default fixed:64)\n"
+            "  -b            the blocking driver is loaded; EAGAIN is an error instead of a retry\n"
+            "  -j            print JSON instead of CSV\n"
+            "  -n            do not print the CSV header\n"
+            "  -l label      label printed with the results\n",
+            name);
+}
+
+int main(int argc, char** argv) {
+
+    options.device = DEFAULT_DEVICE;
+    options.label = "";
+    options.producers = 1;
+    options.consumers = 1;
+    options.seconds = 5;
+    options.header = 1;
+    parse_sizes("fixed:64");
+
+    int option;
+    while((option = getopt(argc, argv, "d:p:c:t:s:bjnl:h")) != -1) {
+
+        switch(option) {
+
+            case 'd': options.device = optarg; break;
+            case 'p': options.producers = atoi(optarg); break;
+            case 'c': options.consumers = atoi(optarg); break;
+            case 't': options.seconds = atof(optarg); break;
+            case 's':
+                if(parse_sizes(optarg) != 0) {
+
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 'b': options.blocking = 1; break;
+            case 'j': options.json = 1; break;
+            case 'n': options.header = 0; break;
+            case 'l': options.label = optarg; break;
+            default:
+                usage(argv[0]);
+                return option == 'h' ? 0 : 2;
+        }
+    }
+    if(options.producers < 1 || options.consumers < 1 || options.seconds <= 0) {
+
+        usage(argv[0]);
+        return 2;
+    }
+    if(options.distribution == SIZE_ZIPF && build_zipf_table() != 0) {
+
+        perror("zipf table");
+        return 1;
+    }
+
+    int fd = open(options.device, O_RDWR);
+    if(fd < 0) {
+
+        perror(options.device);
+        return 1;
+    }
+
+    int total = options.producers + options.consumers;
+    struct bench_thread* threads = calloc(total, sizeof(struct bench_thread));
+    pthread_barrier_init(&start_barrier, NULL, total + 1);
+
+    int i;
+    for(i = 0; i < total; i++) {
+
+        threads[i].id = i;
+        threads[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+        pthread_create(&threads[i].thread, NULL, i < options.producers ? producer : consumer, &threads[i]);
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    unsigned long long start = now_ns();
+    usleep((useconds_t) (options.seconds * 1000000));
+    stop_producers = 1;
+    for(i = 0; i < options.producers; i++) {
+
+        pthread_join(threads[i].thread, NULL);
+    }
+
+    /* Everything written so far is ahead of these in the FIFO, so consumers drain it first */
+    struct bench_thread main_thread = { 0 };
+    char stop_message[2] = { STOP_MARKER, 'x' };
+    for(i = 0; i < options.consumers; i++) {
+
+        write_message(fd, stop_message, sizeof(stop_message), &main_thread);
+    }
+    for(i = options.producers; i < total; i++) {
+
+        pthread_join(threads[i].thread, NULL);
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    close(fd);
+
+    /* Merge the per thread results */
+    unsigned long long written = 0, read_count = 0, read_bytes = 0;
+    unsigned long long write_retries = 0, read_retries = 0, errors = main_thread.errors;
+    unsigned long sample_count = 0;
+    for(i = 0; i < total; i++) {
+
+        if(i < options.producers) {
+
+            written += threads[i].messages;
+            write_retries += threads[i].retries;
+        } else {
+
+            read_count += threads[i].messages;
+            read_bytes += threads[i].bytes;
+            read_retries += threads[i].retries;
+            sample_count += threads[i].latency_count;
+        }
+        errors += threads[i].errors;
+    }
+
+    unsigned long long* samples = malloc((sample_count ? sample_count : 1) * sizeof(unsigned long long));
+    unsigned long filled = 0;
+    for(i = options.producers; i < total; i++) {
+
+        memcpy(samples + filled, threads[i].latencies, threads[i].latency_count * sizeof(unsigned long long));
+        filled += threads[i].latency_count;
+        free(threads[i].latencies);
+    }
+    qsort(samples, sample_count, sizeof(unsigned long long), compare_latencies);
+
+    double ops = read_count / elapsed;
+    double mbps = read_bytes / elapsed / 1e6;
+    unsigned long long p50 = percentile(samples, sample_count, 0.50);
+    unsigned long long p99 = percentile(samples, sample_count, 0.99);
+    unsigned long long p999 = percentile(samples, sample_count, 0.999);
+    unsigned long long maximum = sample_count ? samples[sample_count - 1] : 0;
+
+    if(options.json) {
+
+        printf("{\"label\":\"%s\",\"producers\":%d,\"consumers\":%d,\"mode\":\"%s\",\"sizes\":\"%s\","
+               "\"min_size\":%lu,\"max_size\":%lu,\"seconds\":%.3f,\"written\":%llu,\"read\":%llu,"
+               "\"ops_per_sec\":%.1f,\"mb_per_sec\":%.3f,\"write_retries\":%llu,\"read_retries\":%llu,"
+               "\"errors\":%llu,\"latency_ns\":{\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}}\n",
+               options.label, options.producers, options.consumers, options.blocking ? "blocking" : "nonblocking",
+               distribution_name(), options.min_size, options.max_size, elapsed, written, read_count,
+               ops, mbps, write_retries, read_retries, errors, p50, p99, p999, maximum);
+    } else {
+
+        if(options.header) {
+
+            printf("label,producers,consumers,mode,sizes,min_size,max_size,seconds,written,read,"
+                   "ops_per_sec,mb_per_sec,write_retries,read_retries,errors,p50_ns,p99_ns,p999_ns,max_ns\n");
+        }
+        printf("%s,%d,%d,%s,%s,%lu,%lu,%.3f,%llu,%llu,%.1f,%.3f,%llu,%llu,%llu,%llu,%llu,%llu,%llu\n",
+               options.label, options.producers, options.consumers, options.blocking ? "blocking" : "nonblocking",
+               distribution_name(), options.min_size, options.max_size, elapsed, written, read_count,
+               ops, mbps, write_retries, read_retries, errors, p50, p99, p999, maximum);
+    }
+
+    free(samples);
+    free(threads);
+    free(zipf_cdf);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,229 @@
+/**
+ * @file queueBench.c
+ * @author Alexandru Blinda
+ * @date 6 November 2017
+ * @version 0.1
+ * @brief Microbenchmarks of the message queue operations, run in user space.
+ * Every operation is run by 1, 2, 4, ... threads sharing one queue and
+ * reported as nanoseconds and allocations per operation.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "queueShim.h"
+#include "messageQueue.h"
+
+#define DEFAULT_ITERATIONS 200000
+#define DEFAULT_MESSAGE_SIZE 64
+#define DEFAULT_MAX_THREADS 64
+
+/* One benchmark: setup runs once before the threads start, op once per iteration */
+struct queue_benchmark {
+
+    const char* name;
+    void (*setup)(unsigned long);
+    void (*op)(void);
+};
+
+static struct message_queue* queuep;
+static unsigned long message_size = DEFAULT_MESSAGE_SIZE;
+static unsigned long iterations = DEFAULT_ITERATIONS;
+static pthread_barrier_t start_barrier;
+static volatile int sink;
+
+/* Enqueues one message of message_size bytes, aborting if the queue refuses it */
+static void enqueue_one(void) {
+
+    struct message_queue_data* data = alloc_message_data(message_size);
+    if(data == NULL || enqueue(queuep, data, 0, 0, 0, 0, 0, NULL) != SUCCESS) {
+
+        fprintf(stderr, "queueBench: enqueue failed\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void dequeue_one(void) {
+
+    struct message_queue_data* data = dequeue(queuep);
+    if(data == NULL) {
+
+        fprintf(stderr, "queueBench: dequeue found an empty queue\n");
+        exit(EXIT_FAILURE);
+    }
+    free_message_data(data);
+}
+
+static void setup_empty(unsigned long total) {
+
+    (void) total;
+}
+
+/* Fills the queue so every dequeue finds a message */
+static void setup_full(unsigned long total) {
+
+    unsigned long i;
+    for(i = 0; i < total; i++) {
+
+        enqueue_one();
+    }
+}
+
+static void setup_one(unsigned long total) {
+
+    (void) total;
+    enqueue_one();
+}
+
+static void enqueue_dequeue_one(void) {
+
+    enqueue_one();
+    dequeue_one();
+}
+
+static void is_queue_empty_one(void) {
+
+    sink += is_queue_empty(queuep);
+}
+
+static void is_space_in_queue_one(void) {
+
+    sink += is_space_in_queue(queuep, message_size, NULL);
+}
+
+static const struct queue_benchmark benchmarks[] = {
+
+    { "BM_Enqueue", setup_empty, enqueue_one },
+    { "BM_Dequeue", setup_full, dequeue_one },
+    { "BM_EnqueueDequeue", setup_empty, enqueue_dequeue_one },
+    { "BM_IsQueueEmpty", setup_one, is_queue_empty_one },
+    { "BM_IsSpaceInQueue", setup_one, is_space_in_queue_one }
+};
+
+static void* run_thread(void* arg) {
+
+    void (*op)(void) = (void (*)(void)) arg;
+    pthread_barrier_wait(&start_barrier);
+    unsigned long i;
+    for(i = 0; i < iterations; i++) {
+
+        op();
+    }
+    pthread_barrier_wait(&start_barrier);
+    return NULL;
+}
+
+static double cpu_seconds(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Runs one benchmark with the given number of threads and prints its row */
+static void run_benchmark(const struct queue_benchmark* benchmark, unsigned int threads) {
+
+    pthread_t* tids = (pthread_t*) calloc(threads, sizeof(pthread_t));
+    unsigned long total = iterations * threads;
+
+    queuep = initialise_queue();
+    if(tids == NULL || queuep == NULL) {
+
+        fprintf(stderr, "queueBench: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    queuep->max_messages_size = ULONG_MAX;
+    benchmark->setup(total);
+
+    pthread_barrier_init(&start_barrier, NULL, threads + 1);
+    unsigned int i;
+    for(i = 0; i < threads; i++) {
+
+        pthread_create(&tids[i], NULL, run_thread, (void*) benchmark->op);
+    }
+
+    /* The threads run the operations between the two barriers */
+    unsigned long allocations = __atomic_load_n(&queue_allocations, __ATOMIC_RELAXED);
+    double cpu_start = cpu_seconds();
+    ktime_t start = ktime_get();
+    pthread_barrier_wait(&start_barrier);
+    pthread_barrier_wait(&start_barrier);
+    ktime_t elapsed = ktime_get() - start;
+    double cpu = cpu_seconds() - cpu_start;
+    allocations = __atomic_load_n(&queue_allocations, __ATOMIC_RELAXED) - allocations;
+
+    for(i = 0; i < threads; i++) {
+
+        pthread_join(tids[i], NULL);
+    }
+    pthread_barrier_destroy(&start_barrier);
+    release_queue(queuep);
+    free(tids);
+
+    /* Like Google Benchmark, times are per operation of one thread */
+    char name[64];
+    snprintf(name, sizeof(name), "%s/threads:%u", benchmark->name, threads);
+    printf("%-32s %10.1f ns %10.1f ns %12lu %10.2f %14.0f\n", name,
+           (double) elapsed * threads / total, cpu * 1e9 / total,
+           iterations, (double) allocations / total, total / (elapsed / 1e9));
+}
+
+static void usage(const char* program) {
+
+    fprintf(stderr, "Usage: %s [-n iterations] [-s message size] [-t max threads] [-f name filter]\n", program);
+}
+
+int main(int argc, char** argv) {
+
+    unsigned int max_threads = DEFAULT_MAX_THREADS;
+    const char* filter = NULL;
+    int option;
+
+    while((option = getopt(argc, argv, "n:s:t:f:h")) != -1) {
+
+        switch(option) {
+
+            case 'n':
+                iterations = strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                message_size = strtoul(optarg, NULL, 0);
+                break;
+            case 't':
+                max_threads = strtoul(optarg, NULL, 0);
+                break;
+            case 'f':
+                filter = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return option == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if(iterations == 0 || message_size == 0 || max_threads == 0) {
+
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("Message size: %lu bytes, %lu iterations per thread\n", message_size, iterations);
+    printf("%-32s %13s %13s %12s %10s %14s\n", "Benchmark", "Time", "CPU", "Iterations", "allocs/op", "ops/s");
+    printf("----------------------------------------------------------------------------------------------------\n");
+
+    unsigned int b;
+    for(b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); b++) {
+
+        if(filter != NULL && strstr(benchmarks[b].name, filter) == NULL) {
+
+            continue;
+        }
+
+        unsigned int threads;
+        for(threads = 1; threads <= max_threads; threads *= 2) {
+
+            run_benchmark(&benchmarks[b], threads);
+        }
+    }
+    return EXIT_SUCCESS;
+}
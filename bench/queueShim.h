@@ -0,0 +1,215 @@
+/**
+ * @file queueShim.h
+ * @author Alexandru Blinda
+ * @date 6 November 2017
+ * @version 0.1
+ * @brief User space versions of the kernel functions messageQueue.c uses.
+ * Lets the queue be built and measured without loading a module. Every
+ * allocation is counted in queue_allocations so benchmarks can report
+ * allocations per operation.
+ */
+#ifndef QUEUESHIM_H
+#define QUEUESHIM_H
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define QUEUE_API /* Export the queue functions from the library */
+#define SUCCESS 0
+
+/* Memory */
+#define GFP_KERNEL 0
+#define GFP_KERNEL_ACCOUNT 0
+#define PAGE_SIZE 4096UL
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#define U8_MAX ((unsigned char) ~0U)
+
+extern unsigned long queue_allocations;
+
+struct page {
+
+    char bytes[PAGE_SIZE];
+};
+
+/* Like the kmalloc caches: powers of two from 8 bytes */
+static inline size_t kmalloc_size_roundup(size_t size) {
+
+    size_t rounded = 8;
+    if(size == 0) {
+
+        return 0;
+    }
+    while(rounded < size) {
+
+        rounded *= 2;
+    }
+    return rounded;
+}
+
+static inline void* kmalloc(size_t size, int flags) {
+
+    (void) flags;
+    __atomic_fetch_add(&queue_allocations, 1, __ATOMIC_RELAXED);
+    return malloc(size ? size : 1);
+}
+
+static inline void* kcalloc(size_t count, size_t size, int flags) {
+
+    (void) flags;
+    __atomic_fetch_add(&queue_allocations, 1, __ATOMIC_RELAXED);
+    return calloc(count ? count : 1, size);
+}
+
+static inline void kfree(const void* pointer) {
+
+    free((void*) pointer);
+}
+
+static inline struct page* alloc_page(int flags) {
+
+    return (struct page*) kmalloc(sizeof(struct page), flags);
+}
+
+static inline void __free_page(struct page* page) {
+
+    free(page);
+}
+
+static inline void* page_address(struct page* page) {
+
+    return page->bytes;
+}
+
+/* "User" memory is ordinary memory */
+static inline unsigned long copy_to_user(void* to, const void* from, unsigned long length) {
+
+    memcpy(to, from, length);
+    return 0;
+}
+
+static inline unsigned long copy_from_user(void* to, const void* from, unsigned long length) {
+
+    memcpy(to, from, length);
+    return 0;
+}
+
+/* Locking */
+struct mutex {
+
+    pthread_mutex_t mutex;
+};
+
+#define mutex_init(m) pthread_mutex_init(&(m)->mutex, NULL)
+#define mutex_destroy(m) pthread_mutex_destroy(&(m)->mutex)
+#define mutex_lock(m) pthread_mutex_lock(&(m)->mutex)
+#define mutex_trylock(m) (pthread_mutex_trylock(&(m)->mutex) == 0)
+#define mutex_unlock(m) pthread_mutex_unlock(&(m)->mutex)
+
+/* Wait queues; nothing sleeps on a reply box in user space, so there is nobody to wake */
+typedef struct {
+
+    int unused;
+} wait_queue_head_t;
+#define init_waitqueue_head(w) ((w)->unused = 0)
+#define wake_up(w) do { } while(0)
+
+/* Reference counts */
+typedef struct {
+
+    int refs;
+} refcount_t;
+#define refcount_set(r, n) ((r)->refs = (n))
+#define refcount_inc(r) __atomic_fetch_add(&(r)->refs, 1, __ATOMIC_RELAXED)
+#define refcount_dec_and_test(r) (__atomic_sub_fetch(&(r)->refs, 1, __ATOMIC_ACQ_REL) == 0)
+
+/* Bits */
+#define __set_bit(bit, word) (*(word) |= 1UL << (bit))
+#define __clear_bit(bit, word) (*(word) &= ~(1UL << (bit)))
+#define __fls(word) ((unsigned long) (8 * sizeof(unsigned long) - 1 - __builtin_clzl(word)))
+#define __ffs(word) ((unsigned long) __builtin_ctzl(word))
+
+/* Time */
+typedef long long ktime_t;
+typedef long long s64;
+
+static inline ktime_t ktime_get(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ktime_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#define ktime_sub(a, b) ((a) - (b))
+#define ktime_to_ns(k) (k)
+#define ktime_add_ms(k, ms) ((k) + (ktime_t) (ms) * 1000000LL)
+#define ktime_before(a, b) ((a) < (b))
+
+/* Tracepoints are disabled */
+#define trace_opsysmem_enqueue(...) do { } while(0)
+#define trace_opsysmem_dequeue(...) do { } while(0)
+#define trace_opsysmem_log_read(...) do { } while(0)
+
+/* Statistics are only updated under the queue lock, so plain globals will do */
+#define LATENCY_BUCKETS 48
+
+struct latency_histogram {
+
+    unsigned long buckets[LATENCY_BUCKETS];
+};
+
+struct queue_counters {
+
+    unsigned long long messages_enqueued;
+    unsigned long long bytes_enqueued;
+    unsigned long long messages_dequeued;
+    unsigned long long bytes_dequeued;
+    unsigned long long log_reads;
+    unsigned long long messages_evicted;
+    unsigned long long messages_overrun;
+    unsigned long long messages_expired;
+    unsigned long long messages_delayed;
+    unsigned long long messages_acked;
+    unsigned long long messages_redelivered;
+    unsigned long long messages_dead_lettered;
+    unsigned long long dead_letters_dropped;
+};
+
+/* Every writer is in the same cgroup */
+static inline unsigned long long current_cgroup_id(void) {
+
+    return 0;
+}
+
+/* Lock statistics are a debugfs feature; they stay off in user space */
+#define static_branch_unlikely(key) 0
+static inline void record_lock_acquired(int site, s64 wait_ns) { }
+static inline void record_lock_held(int site, s64 hold_ns) { }
+
+extern struct queue_counters queue_counters;
+extern struct latency_histogram residency_histogram;
+
+#define this_cpu_inc(counter) ((counter)++)
+#define this_cpu_add(counter, value) ((counter) += (value))
+
+static inline void record_latency(struct latency_histogram* histogram, ktime_t start) {
+
+    long long nanoseconds = ktime_get() - start;
+    unsigned int bucket = 0;
+    if(nanoseconds > 1) {
+
+        bucket = 63 - __builtin_clzll(nanoseconds);
+        if(bucket > LATENCY_BUCKETS - 1) {
+
+            bucket = LATENCY_BUCKETS - 1;
+        }
+    }
+    histogram->buckets[bucket]++;
+}
+
+#endif
@@ -16,8 +16,21 @@
 #include <linux/slab.h> /* Header for kmalloc and kfree functions */
 #include <linux/string.h> /* For memcpy, memset, sprintf */
 #include <linux/mutex.h> /* Required for mutex functionality */
+#include <linux/gfp.h> /* For alloc_page and __free_page */
+#include <linux/mm.h> /* For page_address */
+#include <linux/ktime.h> /* For stamping messages with ktime_get */
+#include <linux/workqueue.h> /* For the delayed work reaping expired messages */
+#include <linux/refcount.h> /* Log readers keep a message alive while copying it out */
+#include <linux/compat.h> /* For compat_ptr, used by ioctl from 32 bit processes */
+#include <linux/wait.h> /* Reply boxes wake the tasks waiting for a reply */
 
 #include "charDeviceDriver.h"
+#include "charDeviceDriverStats.h"
+#define CREATE_TRACE_POINTS
+#include "charDeviceDriverTrace.h"
+#include "messageQueue.c" /* The queue itself, shared with the user space benchmarks */
+#include "charDeviceDriverSelfbench.h"
+#include "charDeviceDriverSnapshot.h"
 
 /* LKM description */
 MODULE_LICENSE("GPL");
@@ -26,7 +39,18 @@ MODULE_DESCRIPTION("A device driver for a character device which implements a si
 MODULE_VERSION("0.1");
 
 static struct message_queue* queuep;
-static DEFINE_MUTEX(queue_lock); /* Declare a mutex to be used for accessing queue */
+static DECLARE_DELAYED_WORK(reaper_work, reap_expired); /* Frees expired messages */
+static DECLARE_DELAYED_WORK(promote_work, promote_delayed); /* Appends delayed messages once due */
+static DECLARE_DELAYED_WORK(redeliver_work, redeliver_timed_out); /* Puts back received messages never acknowledged */
+
+/* Shows the stats in /sys/kernel/<module name>/stats */
+static ssize_t stats_show(struct kobject* kobj, struct kobj_attribute* attr, char* buf) {
+
+    struct message_queue_stats stats;
+    collect_stats(queuep, &stats);
+    return print_stats(&stats, buf);
+}
+static struct kobj_attribute stats_attribute = __ATTR_RO(stats);
 
 /*
  * This function is called when the module is loaded
@@ -47,17 +71,38 @@ static int __init char_device_driver_init(void) {
 
     printk(KERN_INFO "'mknod /dev/%s c %d 0'.\n", DEVICE_NAME, major_number);
 
-    mutex_init(&queue_lock);
-
     queuep = initialise_queue(); /* Initialise the globally declared queue */
     /* If queuep could not be allocated, handle the error */
     if(queuep == NULL) {
 
         printk(KERN_ALERT "%s: Failed to allocate memory for queue\n", PRINTING_NAME);
-        mutex_destroy(&queue_lock);
         unregister_chrdev(major_number, DEVICE_NAME);
         return -EFAULT;
     }
+    /* Messages dropped unread go there, with their own size limit, instead of being lost */
+    queuep->dead_letters = initialise_queue();
+    if(queuep->dead_letters == NULL) {
+
+        printk(KERN_ALERT "%s: Failed to allocate memory for dead letter queue\n", PRINTING_NAME);
+        release_queue(queuep);
+        unregister_chrdev(major_number, DEVICE_NAME);
+        return -EFAULT;
+    }
+    queuep->dead_letters->holds_dead_letters = 1;
+
+    /* Measurements are exported through sysfs and debugfs; the driver works without them */
+    stats_kobj = kobject_create_and_add(KBUILD_MODNAME, kernel_kobj);
+    if(stats_kobj != NULL && sysfs_create_file(stats_kobj, &stats_attribute.attr) != 0) {
+
+        printk(KERN_ALERT "%s: Failed to create the sysfs stats file\n", PRINTING_NAME);
+    }
+    debugfs_dir = debugfs_create_dir(KBUILD_MODNAME, NULL);
+    debugfs_create_file("residency_histogram", 0444, debugfs_dir, &residency_histogram, &latency_histogram_fops);
+    debugfs_create_file("selfbench", 0600, debugfs_dir, NULL, &selfbench_fops);
+    debugfs_create_file("lock_stats", 0600, debugfs_dir, NULL, &lock_stats_fops);
+    debugfs_create_file("cgroup_usage", 0444, debugfs_dir, queuep, &cgroup_usage_fops);
+    debugfs_create_file("snapshot", 0400, debugfs_dir, queuep, &snapshot_fops);
+    debugfs_create_u32("snapshot_payload_bytes", 0600, debugfs_dir, &snapshot_payload_bytes);
 
     return SUCCESS;
 }
@@ -67,9 +112,15 @@ static int __init char_device_driver_init(void) {
  */
 static void __exit char_device_driver_exit(void) {
 
+    debugfs_remove_recursive(debugfs_dir); /* Nobody can look at the queue any more */
+    kobject_put(stats_kobj);
+    cancel_delayed_work_sync(&reaper_work);
+    cancel_delayed_work_sync(&promote_work);
+    cancel_delayed_work_sync(&redeliver_work);
+    struct message_queue* dead_letters = queuep->dead_letters;
     release_queue(queuep); /* Free the resources of the globally declared queue */
+    release_queue(dead_letters);
     queuep = NULL;
-    mutex_destroy(&queue_lock);
     unregister_chrdev(major_number, DEVICE_NAME); /* Unregister the major number */
     printk(KERN_INFO "%s: Device driver resources cleaned up\n", PRINTING_NAME);
 }
@@ -85,96 +136,245 @@ static int device_open(struct inode* inodep, struct file* filep) {
 
         return -EAGAIN;
     }
+
+    /* Every file keeps its own reading state, used in log mode */
+    struct message_file_state* statep = (struct message_file_state*) kmalloc(sizeof(struct message_file_state), GFP_KERNEL);
+    if(statep == NULL) {
+
+        module_put(THIS_MODULE);
+        return -ENOMEM;
+    }
+    statep->cursor.last_read_node = NULL;
+    statep->cursor.last_read_sequence = 0;
+    statep->cursor.generation = 0;
+    statep->priority = 0;
+    statep->type = 0;
+    statep->ttl_ms = 0;
+    statep->transaction = NULL;
+    mutex_init(&statep->transaction_lock);
+    init_reply_box(&statep->replies);
+    init_rate_state(&statep->rate);
+    statep->producer = open_producer(queuep);
+    if(statep->producer == NULL) {
+
+        kfree(statep);
+        module_put(THIS_MODULE);
+        return -ENOMEM;
+    }
+    filep->private_data = statep;
     return SUCCESS;
 }
 
 /* Handles process reading from device */
 static ssize_t device_read(struct file* filep, char* buffer, size_t length, loff_t* offset) {
 
-    printk(KERN_INFO "%s: Request to read %zu bytes received.\n", PRINTING_NAME, length);    
+    struct message_file_state* statep = filep->private_data;
 
-    if(is_queue_empty(queuep) != 0) {
+    /* In log mode the message is not removed; we read from our own position */
+    if(queuep->mode == QUEUE_MODE_LOG) {
 
-        printk(KERN_ALERT "%s: Failed to read - empty queue.\n", PRINTING_NAME);
-        return -EAGAIN;
+        ssize_t bytes_read = read_log_message(queuep, &statep->cursor, buffer, length, offset);
+        if(bytes_read < 0) {
+
+            reject_request(0, length, bytes_read);
+        }
+        return bytes_read;
     }
 
+    /* Another reader may empty the queue after is_queue_empty, so only dequeue decides */
     struct message_queue_data* tmp_data = dequeue(queuep);
-    char* tmp_message = tmp_data->message;
-    int bytes_read = 0;
+    if(tmp_data == NULL) {
 
-    
-    /* Ensures we send to the user the specific message */
-    unsigned short tmp_length = 0;
-    if(tmp_data->message_size >= length) {
-        
-        tmp_length = length;
-    } else {
-        
-        tmp_length = tmp_data->message_size;
+        reject_request(0, length, -EAGAIN);
+        return -EAGAIN;
     }
 
-    /* As long as we did not hit null byte and length is not 0 */
-    while(tmp_length && *tmp_message) {
-
-        /* Move the message from kernel space to user space */
-        if(put_user(*(tmp_message++), buffer++) != SUCCESS) {
+    ssize_t bytes_read = copy_message_to_user(tmp_data, buffer, length);
+    if(bytes_read < 0) {
 
-            kfree(tmp_data->message);
-            kfree(tmp_data);
-            return -EFAULT;
-        }
-
-        tmp_length--;
-        bytes_read++;
+        reject_request(0, length, bytes_read);
     }
 
     /* Clean data */
-    kfree(tmp_data->message);
-    kfree(tmp_data);
+    free_message_data(tmp_data);
     return bytes_read;
 }
 
+/* Traces and counts a read or write that failed with the given error */
+static void reject_request(int is_write, size_t length, int error) {
+
+    trace_opsysmem_reject(is_write, length, error);
+    count_reject(error);
+}
+
 /* Handles process writing to device */
 static ssize_t device_write(struct file* filep, const char* buffer, size_t length, loff_t* offset) {
 
-    /* If the length of the message to be written is bigger than 4KB, return EINVAL */
+    struct message_file_state* statep = filep->private_data;
+    return write_message(statep, buffer, length, statep->priority, statep->ttl_ms, 0, 0);
+}
+
+/*
+ * Checks a message coming from the user and enqueues it with the given
+ * priority and time to live, readable from not_before on (0 for now). A
+ * correlation_id other than 0 makes it the message of that call.
+ */
+static ssize_t write_message(struct message_file_state* statep, const char* buffer, size_t length, unsigned int priority, unsigned long ttl_ms, ktime_t not_before, unsigned int correlation_id) {
+
+    if(priority >= MESSAGE_PRIORITY_LEVELS || ttl_ms > MAX_MESSAGE_TTL_MS) {
 
-    printk(KERN_INFO "%s: Request to write %zu bytes received.\n", PRINTING_NAME, length);
+        reject_request(1, length, -EINVAL);
+        return -EINVAL;
+    }
+
+    /* If the length of the message to be written is bigger than MAX_MESSAGE_SIZE, return EINVAL */
     if(length > MAX_MESSAGE_SIZE) {
 
-        printk(KERN_ALERT "%s: Failed to write to device - length exceeds maximum size of message.\n", PRINTING_NAME);
+        reject_request(1, length, -EINVAL);
         return -EINVAL;
     }
 
-    /* If after enqueuing this message, the size of all the messages is bigger than the size defined, EAGAIN */
-    if(is_space_in_queue(queuep, length) == 0) {
+    /*
+     * If after enqueuing this message, the size of all the messages is bigger than the size defined, EAGAIN.
+     * If it is bigger than the queue or the quota of the file, it never fits, EMSGSIZE.
+     * A transaction has its room reserved already, which stage_message checks instead.
+     */
+    if(READ_ONCE(statep->transaction) == NULL) {
+
+        int space = is_space_in_queue(queuep, length, statep->producer);
+        if(space != 1) {
+
+            int error = space == 0 ? -EAGAIN : -EMSGSIZE;
+            reject_request(1, length, error);
+            return error;
+        }
+    }
+
+    /* A file over its rate limit is told to try again later */
+    if(take_rate_tokens(&statep->rate, length) != 0) {
 
-	printk(KERN_ALERT "%s: Failed to write to device - length exceeds maximum total size of messages.\n", PRINTING_NAME);
+        this_cpu_inc(queue_counters.throttled_writes);
+        reject_request(1, length, -EAGAIN);
         return -EAGAIN;
     }
 
-    /* Local copy of the message */
-    char tmp_message[length];
-    memset(tmp_message, '\0', length);
+    /* Allocate the storage of the message and copy it from the user straight into it */
+    struct message_queue_data* tmp_data = alloc_message_data(length);
+    if(tmp_data == NULL) {
 
-    /* Read the characters 1 by 1 until we reach the size */
+        this_cpu_inc(queue_counters.allocation_failures);
+        return_rate_tokens(&statep->rate, length);
 
-    int i;
-    for(i=0; i < length; i++) {
+        reject_request(1, length, -EFAULT);
+        return -EFAULT;
+    }
 
-	    if(get_user(tmp_message[i], buffer+i) != SUCCESS) {
+    if(copy_message_from_user(tmp_data, buffer, length) != SUCCESS) {
 
-            return -EFAULT;
+        free_message_data(tmp_data);
+        return_rate_tokens(&statep->rate, length);
+        reject_request(1, length, -EFAULT);
+        return -EFAULT;
+    }
+
+    /* Inside a transaction the message waits with the others of the transaction */
+    if(READ_ONCE(statep->transaction) != NULL) {
+
+        mutex_lock(&statep->transaction_lock);
+        struct message_transaction* transaction = statep->transaction;
+        int error = -EINVAL; /* Delayed messages cannot be part of one */
+        if(transaction != NULL && not_before == 0) {
+
+            error = stage_message(queuep, transaction, tmp_data, priority, statep->type, ttl_ms, correlation_id);
+        }
+        mutex_unlock(&statep->transaction_lock);
+
+        /* Committed meanwhile; the message is written like any other */
+        if(transaction != NULL) {
+
+            if(error != SUCCESS) {
+
+                free_message_data(tmp_data);
+                return_rate_tokens(&statep->rate, length);
+                reject_request(1, length, error);
+                return error;
+            }
+            return length;
         }
     }
 
-    /* If everything is fine, just continue enqueuing the message */
-    if(enqueue(queuep, tmp_message, length) != SUCCESS) {
+    /* If everything is fine, just continue enqueuing the message; it checks the space again under the lock */
+    int error = enqueue(queuep, tmp_data, priority, statep->type, ttl_ms, not_before, correlation_id, statep->producer);
+    if(error == -EAGAIN || error == -EMSGSIZE) {
+
+        free_message_data(tmp_data);
+        return_rate_tokens(&statep->rate, length);
+        reject_request(1, length, error);
+        return error;
+    }
+    if(error != SUCCESS) {
+
+        this_cpu_inc(queue_counters.allocation_failures);
 
+        free_message_data(tmp_data);
+        return_rate_tokens(&statep->rate, length);
+        reject_request(1, length, -EFAULT);
         return -EFAULT;
     }
-    return i;
+    if(ttl_ms != 0) {
+
+        schedule_delayed_work(&reaper_work, EXPIRY_REAP_INTERVAL);
+    }
+    if(not_before != 0) {
+
+        schedule_queue_work(&promote_work, &queuep->next_due);
+    }
+    return length;
+}
+
+/*
+ * Makes a delayed work run at the time in *duep, which the queue keeps for
+ * its first delayed message or its first visibility timeout. Whoever changes
+ * those calls it afterwards, and each checks it did not act on a stale time,
+ * so the last to set the timer always sets it for the current one.
+ */
+static void schedule_queue_work(struct delayed_work* work, ktime_t* duep) {
+
+    ktime_t due;
+    do {
+
+        due = READ_ONCE(*duep);
+        if(due == 0) {
+
+            return;
+        }
+        s64 delay_ns = ktime_to_ns(ktime_sub(due, ktime_get()));
+        mod_delayed_work(system_wq, work, delay_ns > 0 ? nsecs_to_jiffies(delay_ns + TICK_NSEC - 1) : 0);
+    } while(READ_ONCE(*duep) != due);
+}
+
+/* Appends the delayed messages that are due and sets the timer for the next one */
+static void promote_delayed(struct work_struct* work) {
+
+    promote_delayed_messages(queuep);
+    schedule_queue_work(&promote_work, &queuep->next_due);
+}
+
+/* Puts back the messages whose visibility timeout is over and sets the timer for the next one */
+static void redeliver_timed_out(struct work_struct* work) {
+
+    requeue_timed_out_messages(queuep);
+    schedule_queue_work(&redeliver_work, &queuep->next_timeout);
+}
+
+/* Frees the expired messages; comes back while messages with a time to live are queued */
+static void reap_expired(struct work_struct* work) {
+
+    reap_expired_messages(queuep);
+    if(READ_ONCE(queuep->expiring_count) != 0) {
+
+        schedule_delayed_work(&reaper_work, EXPIRY_REAP_INTERVAL);
+    }
 }
 
 static long device_ioctl(struct file* filep, unsigned int ioctl_num, unsigned long ioctl_param) {
@@ -182,209 +382,617 @@ static long device_ioctl(struct file* filep, unsigned int ioctl_num, unsigned lo
     /* Check if the ioctl_num is CHANGE_MAX_MESSAGES_SIZE */
     if(ioctl_num == CHANGE_MAX_MESSAGES_SIZE) {
 
-        /* Lock because we access shared resources */
-        mutex_lock(&queue_lock);
-        if(ioctl_param > queuep->messages_size) {
+        /* The limit is on the memory the messages take, so it cannot go below what they take now */
+        if(resize_queue(queuep, ioctl_param) != SUCCESS) {
 
-            MAX_MESSAGES_SIZE = ioctl_param;
-            printk(KERN_INFO "%s: New messages size - %lu bytes\n", PRINTING_NAME, MAX_MESSAGES_SIZE);
-            mutex_unlock(&queue_lock);
-            return SUCCESS;
+            return -EINVAL;
         }
-        mutex_unlock(&queue_lock);
+        printk(KERN_INFO "%s: New messages size - %lu bytes\n", PRINTING_NAME, ioctl_param);
+        return SUCCESS;
     }
 
-    /* Otherwise return Inval */
-    return -EINVAL;
-}
+    /* Optional limit on the number of messages, checked together with the size */
+    if(ioctl_num == CHANGE_MAX_MESSAGES_COUNT) {
 
-/* Handles process releasing the device */
-static int device_release(struct inode* inodep, struct file* filep) {
+        if(set_max_messages_count(queuep, ioctl_param) != SUCCESS) {
 
-    /*
-     * Decrement the number of processes using this device
-     * Useful so we do not remove the driver when it is in use
-     */
-    module_put(THIS_MODULE);
-    return SUCCESS;
-}
+            return -EINVAL;
+        }
+        printk(KERN_INFO "%s: New messages count - %lu\n", PRINTING_NAME, ioctl_param);
+        return SUCCESS;
+    }
 
-static struct message_queue* initialise_queue(void) {
+    /* Messages bigger than a page are stored in pages, up to MAX_MESSAGE_SIZE_LIMIT */
+    if(ioctl_num == CHANGE_MAX_MESSAGE_SIZE) {
 
-    mutex_lock(&queue_lock);
-    struct message_queue* queuep = (struct message_queue*) kmalloc(sizeof(struct message_queue), GFP_KERNEL);
+        if(ioctl_param == 0 || ioctl_param > MAX_MESSAGE_SIZE_LIMIT) {
 
-    if(queuep != NULL) {
+            return -EINVAL;
+        }
 
-        queuep->head = queuep->rear = NULL;
-        queuep->messages_size = 0;
+        lock_queue(queuep, LOCK_SITE_IOCTL);
+        MAX_MESSAGE_SIZE = ioctl_param;
+        printk(KERN_INFO "%s: New message size - %lu bytes\n", PRINTING_NAME, MAX_MESSAGE_SIZE);
+        unlock_queue(queuep);
+        return SUCCESS;
     }
-    mutex_unlock(&queue_lock);
-    return queuep;
-}
 
-static void release_queue(struct message_queue* queuep) {
+    /* Switch between destructive FIFO reads and the persistent log */
+    if(ioctl_num == CHANGE_QUEUE_MODE) {
 
-    mutex_lock(&queue_lock);
-    /* If the pointer is null, we cannot release anything */
-    if(queuep == NULL) {
+        if(ioctl_param != QUEUE_MODE_FIFO && ioctl_param != QUEUE_MODE_LOG && ioctl_param != QUEUE_MODE_PRIORITY
+                && ioctl_param != QUEUE_MODE_FAIR && ioctl_param != QUEUE_MODE_RING && ioctl_param != QUEUE_MODE_TYPED) {
+
+            return -EINVAL;
+        }
+
+        lock_queue(queuep, LOCK_SITE_IOCTL);
+        /* Priority, fair and typed modes keep messages in other lists, so only an empty queue can move in or out of them */
+        int own_lists = queuep->mode == QUEUE_MODE_PRIORITY || queuep->mode == QUEUE_MODE_FAIR || queuep->mode == QUEUE_MODE_TYPED
+                        || ioctl_param == QUEUE_MODE_PRIORITY || ioctl_param == QUEUE_MODE_FAIR || ioctl_param == QUEUE_MODE_TYPED;
+        if(queuep->mode != ioctl_param && own_lists && queuep->messages_count != 0) {
+
+            unlock_queue(queuep);
+            return -EBUSY;
+        }
+        /* Staged messages are kept in the lists of the mode they were written in */
+        if(queuep->mode != ioctl_param && queuep->transactions_count != 0) {
+
+            unlock_queue(queuep);
+            return -EBUSY;
+        }
+        /* Log readers rely on messages never coming back into the list */
+        if(ioctl_param == QUEUE_MODE_LOG && queuep->inflight_count != 0) {
+
+            unlock_queue(queuep);
+            return -EBUSY;
+        }
+        if(queuep->mode != ioctl_param) {
+
+            /* Forgets the last node of every log cursor, which another mode may have freed */
+            queuep->requeue_generation++;
+        }
+        queuep->mode = ioctl_param;
+        printk(KERN_INFO "%s: New queue mode - %lu\n", PRINTING_NAME, ioctl_param);
+        unlock_queue(queuep);
+        return SUCCESS;
+    }
+
+    /* Priority used by write() on this file */
+    if(ioctl_num == CHANGE_DEFAULT_PRIORITY) {
+
+        if(ioctl_param >= MESSAGE_PRIORITY_LEVELS) {
+
+            return -EINVAL;
+        }
 
-        mutex_unlock(&queue_lock);
-        return;
+        struct message_file_state* statep = filep->private_data;
+        statep->priority = ioctl_param;
+        return SUCCESS;
     }
 
-    /* Lock because we are going to access the queue and modify it */
-    /* If the head is not null, go through all the nodes and free them 1 by 1 */
-    struct message_queue_node* tmp_node = queuep->head;
-    struct message_queue_node* iterator_node = tmp_node;
-    while(iterator_node != NULL) {
+    /* Type of every message written on this file, which typed mode selects on */
+    if(ioctl_num == CHANGE_MESSAGE_TYPE) {
+
+        if(ioctl_param >= MESSAGE_TYPES) {
+
+            return -EINVAL;
+        }
 
-        iterator_node = iterator_node->next;
-        if(tmp_node->data != NULL) {
+        struct message_file_state* statep = filep->private_data;
+        statep->type = ioctl_param;
+        return SUCCESS;
+    }
+
+    /* Time to live of messages written with write() on this file */
+    if(ioctl_num == CHANGE_MESSAGE_TTL) {
+
+        if(ioctl_param > MAX_MESSAGE_TTL_MS) {
+
+            return -EINVAL;
+        }
+
+        struct message_file_state* statep = filep->private_data;
+        statep->ttl_ms = ioctl_param;
+        return SUCCESS;
+    }
+
+    /* Limit on what this file may have queued, so one writer cannot take all the space */
+    if(ioctl_num == CHANGE_PRODUCER_QUOTA) {
+
+        struct message_file_state* statep = filep->private_data;
+        lock_queue(queuep, LOCK_SITE_IOCTL);
+        statep->producer->quota = ioctl_param;
+        unlock_queue(queuep);
+        return SUCCESS;
+    }
+
+    /* Token buckets for writes on this file */
+    if(ioctl_num == SET_RATE_LIMIT) {
+
+        struct message_rate_limit limit;
+        if(copy_from_user(&limit, (struct message_rate_limit*) ioctl_param, sizeof(limit)) != 0) {
+
+            return -EFAULT;
+        }
+        struct message_file_state* statep = filep->private_data;
+        return set_rate_limit(&statep->rate, &limit);
+    }
+
+    /* Write with explicit options */
+    if(ioctl_num == SEND_MESSAGE) {
+
+        struct message_send_request request;
+        if(copy_from_user(&request, (struct message_send_request*) ioctl_param, sizeof(request)) != 0) {
+
+            return -EFAULT;
+        }
+        struct message_file_state* statep = filep->private_data;
+        return write_message(statep, u64_to_user_ptr(request.message), request.message_size, request.priority, statep->ttl_ms, 0, 0);
+    }
+
+    /* Write with a time to live of its own */
+    if(ioctl_num == SEND_MESSAGE_TTL) {
+
+        struct message_send_ttl_request request;
+        if(copy_from_user(&request, (struct message_send_ttl_request*) ioctl_param, sizeof(request)) != 0) {
+
+            return -EFAULT;
+        }
+        struct message_file_state* statep = filep->private_data;
+        return write_message(statep, u64_to_user_ptr(request.message), request.message_size, request.priority, request.ttl_ms, 0, 0);
+    }
+
+    /* Write that cannot be read before a given time */
+    if(ioctl_num == SEND_MESSAGE_DELAYED) {
+
+        struct message_send_delayed_request request;
+        if(copy_from_user(&request, (struct message_send_delayed_request*) ioctl_param, sizeof(request)) != 0) {
+
+            return -EFAULT;
+        }
+        if(request.not_before_ns > ktime_get() + MAX_MESSAGE_DELAY_NS) {
+
+            return -EINVAL;
+        }
+        struct message_file_state* statep = filep->private_data;
+        return write_message(statep, u64_to_user_ptr(request.message), request.message_size, request.priority, request.ttl_ms,
+                             ns_to_ktime(request.not_before_ns), 0);
+    }
 
-            if(tmp_node->data->message != NULL) {
+    /* Read that keeps the message until it is acknowledged */
+    if(ioctl_num == RECEIVE_MESSAGE) {
 
-                kfree(tmp_node->data->message);
+        struct message_receive_request request;
+        struct message_receive_request* userp = (struct message_receive_request*) ioctl_param;
+        if(copy_from_user(&request, userp, sizeof(request)) != 0) {
+
+            return -EFAULT;
+        }
+        struct message_inflight* inflight = (struct message_inflight*) kmalloc(sizeof(struct message_inflight), GFP_KERNEL_ACCOUNT);
+        if(inflight == NULL) {
+
+            return -ENOMEM;
+        }
+
+        ssize_t bytes_read = receive_message(queuep, inflight, u64_to_user_ptr(request.buffer), request.buffer_size, &request.receipt);
+        if(bytes_read < 0) {
+
+            /* After a failed copy the queue has disposed of the record */
+            if(bytes_read != -EFAULT) {
+
+                kfree(inflight);
             }
-            kfree(tmp_node->data);
+            reject_request(0, request.buffer_size, bytes_read);
+            return bytes_read;
+        }
+        schedule_queue_work(&redeliver_work, &queuep->next_timeout);
+
+        /* A reader that cannot be told the receipt gets the message again after the timeout */
+        if(put_user(request.receipt, &userp->receipt) != 0) {
+
+            return -EFAULT;
         }
-        kfree(tmp_node);
-        tmp_node = iterator_node;
+        return bytes_read;
     }
-    kfree(queuep);
-    mutex_unlock(&queue_lock);
-}
 
-static int enqueue(struct message_queue* queuep, char* message, unsigned short message_size) {
+    /* Removes a received message for good */
+    if(ioctl_num == ACK_MESSAGE) {
 
-    /* Nothing happens */
-    mutex_lock(&queue_lock);
-    if(queuep == NULL) {
+        __u64 receipt;
+        if(get_user(receipt, (__u64*) ioctl_param) != 0) {
+
+            return -EFAULT;
+        }
+        return ack_message(queuep, receipt);
+    }
+
+    /* Takes the oldest message out of the dead letter queue; it never waits */
+    if(ioctl_num == READ_DEAD_LETTER) {
+
+        struct message_read_request request;
+        if(copy_from_user(&request, (struct message_read_request*) ioctl_param, sizeof(request)) != 0) {
 
-        mutex_unlock(&queue_lock);
+            return -EFAULT;
+        }
+        struct message_queue_data* tmp_data = dequeue(queuep->dead_letters);
+        if(tmp_data == NULL) {
+
+            return -EAGAIN;
+        }
+
+        ssize_t bytes_read = copy_message_to_user(tmp_data, u64_to_user_ptr(request.buffer), request.buffer_size);
+        free_message_data(tmp_data);
+        return bytes_read;
+    }
+
+    /* Receptions after which a message that is not acknowledged goes to the dead letter queue */
+    if(ioctl_num == CHANGE_MAX_DELIVERIES) {
+
+        if(ioctl_param > U8_MAX) {
+
+            return -EINVAL;
+        }
+
+        lock_queue(queuep, LOCK_SITE_IOCTL);
+        queuep->max_deliveries = ioctl_param;
+        printk(KERN_INFO "%s: New max deliveries - %u\n", PRINTING_NAME, queuep->max_deliveries);
+        unlock_queue(queuep);
         return SUCCESS;
     }
-    mutex_unlock(&queue_lock);
 
-    /* Allocate memory for a node */
-    struct message_queue_node* tmp_node = (struct message_queue_node*) kmalloc(sizeof(struct message_queue_node), GFP_KERNEL);
+    /* Like CHANGE_MAX_MESSAGES_SIZE, for the dead letter queue */
+    if(ioctl_num == CHANGE_DEAD_LETTERS_SIZE) {
 
-    /* If allocation failed, return -1 */
-    if(tmp_node == NULL) {
+        struct message_queue* dead_letters = queuep->dead_letters;
+        lock_queue(dead_letters, LOCK_SITE_IOCTL);
+        if(ioctl_param > dead_letters->messages_footprint) {
 
-        return -1;
+            dead_letters->max_messages_size = ioctl_param;
+            printk(KERN_INFO "%s: New dead letters size - %lu bytes\n", PRINTING_NAME, dead_letters->max_messages_size);
+            unlock_queue(dead_letters);
+            return SUCCESS;
+        }
+        unlock_queue(dead_letters);
+        return -EINVAL;
     }
 
-    /* If it was successful, allocate memory for data */
-    tmp_node->next = NULL;
-    tmp_node->data = (struct message_queue_data*) kmalloc(sizeof(struct message_queue_data), GFP_KERNEL);
+    /* Holds back the writes on this file until COMMIT_TRANSACTION */
+    if(ioctl_num == BEGIN_TRANSACTION) {
+
+        struct message_transaction_request request;
+        if(copy_from_user(&request, (struct message_transaction_request*) ioctl_param, sizeof(request)) != 0) {
+
+            return -EFAULT;
+        }
+        struct message_transaction* transaction = (struct message_transaction*) kmalloc(sizeof(struct message_transaction), GFP_KERNEL_ACCOUNT);
+        if(transaction == NULL) {
+
+            return -ENOMEM;
+        }
 
-    /* If allocation failed, clean and return -1 */
-    if(tmp_node->data == NULL) {
+        struct message_file_state* statep = filep->private_data;
+        mutex_lock(&statep->transaction_lock);
+        int error = -EBUSY; /* One at a time per file */
+        if(statep->transaction == NULL) {
 
-        kfree(tmp_node);
-        return -1;
+            error = begin_transaction(queuep, transaction, statep->producer, request.max_messages, request.max_size);
+        }
+        if(error == SUCCESS) {
+
+            WRITE_ONCE(statep->transaction, transaction);
+        }
+        mutex_unlock(&statep->transaction_lock);
+
+        if(error != SUCCESS) {
+
+            kfree(transaction);
+        }
+        return error;
     }
 
-    tmp_node->data->message = (char*) kmalloc(message_size * sizeof(char), GFP_KERNEL);
-    /* If allocation failed, clean and return -1 */
-    if(tmp_node->data->message == NULL) {
+    /* Ends the transaction of this file, making its messages readable or throwing them away */
+    if(ioctl_num == COMMIT_TRANSACTION || ioctl_num == ABORT_TRANSACTION) {
+
+        struct message_file_state* statep = filep->private_data;
+        mutex_lock(&statep->transaction_lock);
+        struct message_transaction* transaction = statep->transaction;
+        WRITE_ONCE(statep->transaction, NULL);
+        mutex_unlock(&statep->transaction_lock);
+        if(transaction == NULL) {
+
+            return -EINVAL;
+        }
+
+        if(ioctl_num == COMMIT_TRANSACTION) {
 
-        kfree(tmp_node->data);
-        kfree(tmp_node);
-        return -1;
+            commit_transaction(queuep, transaction);
+            this_cpu_inc(queue_counters.transactions_committed);
+            if(transaction->expiring_count != 0) {
+
+                schedule_delayed_work(&reaper_work, EXPIRY_REAP_INTERVAL);
+            }
+        } else {
+
+            abort_transaction(queuep, transaction);
+            this_cpu_inc(queue_counters.transactions_aborted);
+        }
+        kfree(transaction);
+        return SUCCESS;
     }
-    memcpy(tmp_node->data->message, message, message_size);
-    tmp_node->data->message_size = message_size;
 
-    mutex_lock(&queue_lock);
-    /* It means this is our first element to be added */
-    if(queuep->rear == NULL) {
+    /* Sends a message whose reply comes back to this file only */
+    if(ioctl_num == CALL_MESSAGE) {
 
-        queuep->head = queuep->rear = tmp_node;
-    } else { /* It is not our first element */
+        struct message_call_request request;
+        struct message_call_request* userp = (struct message_call_request*) ioctl_param;
+        if(copy_from_user(&request, userp, sizeof(request)) != 0) {
+
+            return -EFAULT;
+        }
+        struct message_call* call = (struct message_call*) kmalloc(sizeof(struct message_call), GFP_KERNEL_ACCOUNT);
+        if(call == NULL) {
+
+            return -ENOMEM;
+        }
 
-        queuep->rear->next = tmp_node;
-        queuep->rear = queuep->rear->next;
+        /* Filed before the message is sent, so even the fastest reply finds it */
+        struct message_file_state* statep = filep->private_data;
+        unsigned int correlation_id = open_call(queuep, call, &statep->replies);
+        ssize_t bytes_written = write_message(statep, u64_to_user_ptr(request.message), request.message_size, request.priority, statep->ttl_ms, 0,
+                                              correlation_id);
+        if(bytes_written < 0) {
+
+            cancel_call(queuep, call);
+            kfree(call);
+            return bytes_written;
+        }
+        this_cpu_inc(queue_counters.calls_sent);
+
+        /* The reply still comes; READ_REPLY tells its ID */
+        if(put_user(correlation_id, &userp->correlation_id) != 0) {
+
+            return -EFAULT;
+        }
+        return bytes_written;
     }
 
-    queuep->messages_size = queuep->messages_size + queuep->rear->data->message_size;
-    mutex_unlock(&queue_lock);
-    return SUCCESS;
-}
+    /* Reads like read() and tells which call the message is, so it can be replied to */
+    if(ioctl_num == READ_CALL) {
 
-static struct message_queue_data* dequeue(struct message_queue* queuep) {
+        struct message_call_read_request request;
+        struct message_call_read_request* userp = (struct message_call_read_request*) ioctl_param;
+        if(copy_from_user(&request, userp, sizeof(request)) != 0) {
 
-    /* Cannot dequeue an empty queue */
-    mutex_lock(&queue_lock);
-    if(queuep == NULL) {
+            return -EFAULT;
+        }
+        /* Log readers do not remove messages, so a call would be answered by all of them; dequeue_call refuses it under the lock */
+        struct message_queue_data* tmp_data = dequeue_call(queuep, &request.correlation_id);
+        if(tmp_data == NULL) {
+
+            if(READ_ONCE(queuep->mode) == QUEUE_MODE_LOG) {
+
+                return -EINVAL;
+            }
+            reject_request(0, request.buffer_size, -EAGAIN);
+            return -EAGAIN;
+        }
 
-        mutex_unlock(&queue_lock);
-        return NULL;
+        ssize_t bytes_read = copy_message_to_user(tmp_data, u64_to_user_ptr(request.buffer), request.buffer_size);
+        free_message_data(tmp_data);
+        if(bytes_read < 0) {
+
+            reject_request(0, request.buffer_size, bytes_read);
+            return bytes_read;
+        }
+        if(put_user(request.correlation_id, &userp->correlation_id) != 0) {
+
+            return -EFAULT;
+        }
+        return bytes_read;
     }
 
-    /* If there is no message in the queue, we cannot dequeue */
-    if(queuep->head == NULL) {
+    /* Hands a reply straight to the file that made the call */
+    if(ioctl_num == SEND_REPLY) {
+
+        struct message_reply_request request;
+        if(copy_from_user(&request, (struct message_reply_request*) ioctl_param, sizeof(request)) != 0) {
+
+            return -EFAULT;
+        }
+        if(request.message_size > MAX_MESSAGE_SIZE) {
+
+            return -EINVAL;
+        }
+        struct message_queue_data* reply = alloc_message_data(request.message_size);
+        if(reply == NULL) {
+
+            this_cpu_inc(queue_counters.allocation_failures);
+            return -ENOMEM;
+        }
+        if(copy_message_from_user(reply, u64_to_user_ptr(request.message), request.message_size) != SUCCESS) {
+
+            free_message_data(reply);
+            return -EFAULT;
+        }
+
+        /* A reply takes room in the queue until it is read */
+        int error = post_reply(queuep, request.correlation_id, reply);
+        if(error != SUCCESS) {
 
-        mutex_unlock(&queue_lock);
-        return NULL;
+            free_message_data(reply);
+            if(error == -EINVAL) {
+
+                this_cpu_inc(queue_counters.replies_refused);
+            }
+            return error;
+        }
+        this_cpu_inc(queue_counters.replies_sent);
+        return request.message_size;
     }
 
-    /* If we are in the case of one element in the queue, just move the rear to NULL */
-    if(queuep->head == queuep->rear) {
+    /* Reads the oldest reply to a call made on this file */
+    if(ioctl_num == READ_REPLY) {
+
+        struct message_call_read_request request;
+        struct message_call_read_request* userp = (struct message_call_read_request*) ioctl_param;
+        if(copy_from_user(&request, userp, sizeof(request)) != 0) {
+
+            return -EFAULT;
+        }
+
+        struct message_file_state* statep = filep->private_data;
+        struct message_queue_data* reply;
+        int error = take_reply(queuep, &statep->replies, &reply, &request.correlation_id);
+        if(error == -ECANCELED) {
+
+            /* The caller learns which call will never get a reply */
+            if(put_user(request.correlation_id, &userp->correlation_id) != 0) {
+
+                return -EFAULT;
+            }
+        }
+        if(error != SUCCESS) {
+
+            return error;
+        }
+
+        ssize_t bytes_read = copy_message_to_user(reply, u64_to_user_ptr(request.buffer), request.buffer_size);
+        free_message_data(reply);
+        if(bytes_read < 0) {
+
+            return bytes_read;
+        }
+        if(put_user(request.correlation_id, &userp->correlation_id) != 0) {
 
-        queuep->rear = queuep->rear->next;
+            return -EFAULT;
+        }
+        return bytes_read;
     }
-    /* If there is message in the queue, fetch it */
-    struct message_queue_node* tmp_node = queuep->head;
-    /* Move the head to the next element */
-    queuep->head = queuep->head->next;
-    queuep->messages_size = queuep->messages_size - tmp_node->data->message_size;
 
-    mutex_unlock(&queue_lock);
+    /* Reads the oldest message of a type; it never waits */
+    if(ioctl_num == READ_MESSAGE_TYPE) {
 
-    struct message_queue_data* tmp_data = tmp_node->data;
-    /* Free the fetched node */
-    kfree(tmp_node);
-    return tmp_data;
-}
+        struct message_type_read_request request;
+        struct message_type_read_request* userp = (struct message_type_read_request*) ioctl_param;
+        if(copy_from_user(&request, userp, sizeof(request)) != 0) {
+
+            return -EFAULT;
+        }
+        if(request.type >= MESSAGE_TYPES || queuep->mode != QUEUE_MODE_TYPED) {
 
-static int is_queue_empty(struct message_queue* queuep) {
+            return -EINVAL;
+        }
 
-    mutex_lock(&queue_lock);
-    if(queuep == NULL) {
+        struct message_queue_data* tmp_data = dequeue_type(queuep, request.type, request.lowest != 0, &request.read_type);
+        if(tmp_data == NULL) {
+
+            reject_request(0, request.buffer_size, -EAGAIN);
+            return -EAGAIN;
+        }
 
-        mutex_unlock(&queue_lock);
-        return -1;
+        ssize_t bytes_read = copy_message_to_user(tmp_data, u64_to_user_ptr(request.buffer), request.buffer_size);
+        free_message_data(tmp_data);
+        if(bytes_read < 0) {
+
+            reject_request(0, request.buffer_size, bytes_read);
+            return bytes_read;
+        }
+        if(put_user(request.read_type, &userp->read_type) != 0) {
+
+            return -EFAULT;
+        }
+        return bytes_read;
+    }
+
+    /* Time received messages wait for ACK_MESSAGE before being read again */
+    if(ioctl_num == CHANGE_VISIBILITY_TIMEOUT) {
+
+        if(ioctl_param == 0 || ioctl_param > MAX_VISIBILITY_TIMEOUT_MS) {
+
+            return -EINVAL;
+        }
+
+        lock_queue(queuep, LOCK_SITE_IOCTL);
+        queuep->visibility_timeout_ms = ioctl_param;
+        printk(KERN_INFO "%s: New visibility timeout - %lu ms\n", PRINTING_NAME, queuep->visibility_timeout_ms);
+        unlock_queue(queuep);
+        return SUCCESS;
     }
 
-    if(queuep->messages_size == 0) {
+    /* Counters for monitoring, gathered without the queue lock */
+    if(ioctl_num == GET_STATS) {
+
+        struct message_queue_stats stats;
+        collect_stats(queuep, &stats);
+        if(copy_to_user((struct message_queue_stats*) ioctl_param, &stats, sizeof(stats)) != 0) {
 
-        mutex_unlock(&queue_lock);
-        return 1;
+            return -EFAULT;
+        }
+        return SUCCESS;
     }
 
-    mutex_unlock(&queue_lock);
-    return 0;
+    /* Otherwise not one of our commands */
+    return -ENOTTY;
 }
 
-static int is_space_in_queue(struct message_queue* queuep, unsigned short length) {
+#ifdef CONFIG_COMPAT
+/*
+ * Handles ioctl from 32 bit processes. The structs are the same for them, so
+ * only the argument of the commands taking one has to become a pointer again.
+ */
+static long device_compat_ioctl(struct file* filep, unsigned int ioctl_num, unsigned long ioctl_param) {
 
-    mutex_lock(&queue_lock);
-    if(queuep == NULL) {
+    if(_IOC_DIR(ioctl_num) != _IOC_NONE) {
 
-        mutex_unlock(&queue_lock);
-        return -1;
+        ioctl_param = (unsigned long) compat_ptr(ioctl_param);
     }
+    return device_ioctl(filep, ioctl_num, ioctl_param);
+}
+#endif
 
-    if(queuep->messages_size + length > MAX_MESSAGES_SIZE) {
+/*
+ * Handles process seeking in the device.
+ * Only log mode has positions: the file position is the sequence number of
+ * the next message the file will read.
+ */
+static loff_t device_llseek(struct file* filep, loff_t offset, int whence) {
+
+    if(queuep->mode != QUEUE_MODE_LOG) {
+
+        return -ESPIPE;
+    }
 
-        mutex_unlock(&queue_lock);
-        return 0;
+    loff_t new_position = seek_log(queuep, offset, whence, filep->f_pos);
+    if(new_position >= 0) {
+
+        filep->f_pos = new_position;
     }
+    return new_position;
+}
+
+/* Handles process releasing the device */
+static int device_release(struct inode* inodep, struct file* filep) {
 
-    mutex_unlock(&queue_lock);
-    return 1;
+    struct message_file_state* statep = filep->private_data;
+    if(statep->transaction != NULL) {
+
+        abort_transaction(queuep, statep->transaction);
+        this_cpu_inc(queue_counters.transactions_aborted);
+        kfree(statep->transaction);
+    }
+    mutex_destroy(&statep->transaction_lock);
+    close_reply_box(queuep, &statep->replies);
+    close_producer(queuep, statep->producer); /* Its messages stay readable */
+    kfree(statep);
+    filep->private_data = NULL;
+
+    /*
+     * Decrement the number of processes using this device
+     * Useful so we do not remove the driver when it is in use
+     */
+    module_put(THIS_MODULE);
+    return SUCCESS;
 }
 
 module_init(char_device_driver_init);
@@ -10,14 +10,25 @@
 #ifndef CHARDEVICEDRIVER_H
 #define CHARDEVICEDRIVER_H
 
+#include "charDeviceDriverIoctl.h"
+#include "messageQueue.h"
+#include "charDeviceDriverRate.h"
+
 #define PRINTING_NAME "CharDeviceDriver"
 #define SUCCESS 0
 #define DEVICE_NAME "opsysmem" /* The device will appear as /dev/opsysmem */
-#define MAX_MESSAGE_SIZE 4096 /* 4KiB in bytes; subject to change */
-#define CHANGE_MAX_MESSAGES_SIZE 0 /* Used for ioctl check */
-static unsigned long MAX_MESSAGES_SIZE = 2097152; /* 2MiB in bytes; subject to change */
+#define MAX_MESSAGE_SIZE_LIMIT 1048576 /* 1MiB in bytes; the most CHANGE_MAX_MESSAGE_SIZE accepts */
+#define MAX_MESSAGE_TTL_MS 2592000000UL /* 30 days in milliseconds; the longest time to live accepted */
+#define EXPIRY_REAP_INTERVAL (HZ / 10) /* Jiffies between reaps while messages with a time to live are queued */
+#define MAX_MESSAGE_DELAY_NS (2592000ULL * NSEC_PER_SEC) /* 30 days; the furthest not_before_ns accepted */
+#define MAX_VISIBILITY_TIMEOUT_MS 43200000UL /* 12 hours in milliseconds */
+#define DEFAULT_REPLY_TIMEOUT_MS 30000UL /* How long READ_REPLY waits when its timeout_ms is 0 */
+#define MAX_REPLY_TIMEOUT_MS 43200000UL /* 12 hours in milliseconds */
+static unsigned long MAX_MESSAGE_SIZE = 4096; /* 4KiB in bytes; subject to change */
 static int major_number; /* major number assigned to our device driver */
 
+struct message_file_state;
+
 /* Prototype functions for file operations */
 static int __init char_device_driver_init(void);
 static void __exit char_device_driver_exit(void);
@@ -26,6 +37,16 @@ static int device_release(struct inode*, struct file*);
 static ssize_t device_read(struct file*, char*, size_t, loff_t*);
 static ssize_t device_write(struct file*, const char*, size_t, loff_t*);
 static long device_ioctl(struct file*, unsigned int, unsigned long);
+#ifdef CONFIG_COMPAT
+static long device_compat_ioctl(struct file*, unsigned int, unsigned long);
+#endif
+static loff_t device_llseek(struct file*, loff_t, int);
+static ssize_t write_message(struct message_file_state*, const char*, size_t, unsigned int, unsigned long, ktime_t, unsigned int);
+static void reap_expired(struct work_struct*);
+static void promote_delayed(struct work_struct*);
+static void redeliver_timed_out(struct work_struct*);
+static void schedule_queue_work(struct delayed_work*, ktime_t*);
+static void reject_request(int, size_t, int);
 
 /*
  * Devices are represented as file structures in kernel.
@@ -36,39 +57,29 @@ static struct file_operations fops = {
 	.read = device_read,
 	.write = device_write,
 	.unlocked_ioctl = device_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl = device_compat_ioctl,
+#endif
+	.llseek = device_llseek,
 	.open = device_open,
 	.release = device_release
 };
 
-/* Declaring queue struct and operations on it */
-
-/* Struct to hold the message and the message size */
-struct message_queue_data {
-
-    char* message; /* The stored message */
-    unsigned short message_size; /* Max message size is 4096 so short can hold it */
-};
-
-/* Struct to represent the node of a queue (data and next element) */
-struct message_queue_node {
-
-    struct message_queue_data* data;
-    struct message_queue_node* next;
-};
-
-/* Struct to represent the queue - it holds the head of the queue and the size */
-struct message_queue {
+/*
+ * Struct kept in file->private_data for every open file.
+ * In log mode the cursor remembers where this file is reading.
+ */
+struct message_file_state {
 
-    struct message_queue_node* head;
-    struct message_queue_node* rear;
-    unsigned long messages_size; /* Size of all messages stored in queue*/
+    struct message_log_cursor cursor;
+    unsigned int priority; /* Priority given to messages sent with write() */
+    unsigned int type; /* Type given to every message sent on this file */
+    struct message_producer* producer; /* Writer of the messages sent on this file */
+    struct message_rate_state rate; /* Limits set with SET_RATE_LIMIT */
+    unsigned long ttl_ms; /* Time to live of messages sent with write(); 0 for ever */
+    struct message_transaction* transaction; /* Where its writes go until it commits; NULL if none is open */
+    struct mutex transaction_lock; /* Held while transaction is used or changed */
+    struct message_reply_box replies; /* Replies to the calls made on this file */
 };
 
-static struct message_queue* initialise_queue(void);
-static void release_queue(struct message_queue*);
-static int enqueue(struct message_queue*, char*, unsigned short);
-static struct message_queue_data* dequeue(struct message_queue*);
-static int is_queue_empty(struct message_queue*);
-static int is_space_in_queue(struct message_queue*, unsigned short);
-
 #endif
@@ -0,0 +1,307 @@
+/**
+ * @file charDeviceDriverIoctl.h
+ * @author Alexandru Blinda
+ * @date 6 November 2017
+ * @version 0.1
+ * @brief Header file that declares the ioctl commands understood by the device.
+ * Only uses uapi headers so user space programs can include it as well.
+ * Part of exercise 3 for Operating Systems Module (creating a character device
+ * driver).
+ */
+#ifndef CHARDEVICEDRIVERIOCTL_H
+#define CHARDEVICEDRIVERIOCTL_H
+
+#include <linux/ioctl.h> /* _IO, _IOR, _IOW and _IOWR, in user space as well */
+#include <linux/types.h> /* __u32 and __u64, the same size for 32 and 64 bit programs */
+
+/*
+ * ioctl commands. They are numbered under their own magic, with the
+ * direction and size of their struct, so commands meant for another driver,
+ * or generic ones like FIBMAP, are refused with ENOTTY instead of being taken
+ * for ours. The structs only have fixed size fields, pointers passed as
+ * __u64, so 32 bit programs use the same ones on a 64 bit kernel.
+ * Commands without a struct take their parameter as the ioctl argument itself.
+ */
+#define OPSYSMEM_IOC_MAGIC 0xB9
+#define CHANGE_MAX_MESSAGES_SIZE _IO(OPSYSMEM_IOC_MAGIC, 0) /* Parameter is the most memory the queued messages may take, overhead included */
+#define CHANGE_QUEUE_MODE _IO(OPSYSMEM_IOC_MAGIC, 1) /* Parameter is one of the QUEUE_MODE_* values below */
+#define CHANGE_DEFAULT_PRIORITY _IO(OPSYSMEM_IOC_MAGIC, 2) /* Parameter is the priority of messages written with write() on this file */
+#define SEND_MESSAGE _IOW(OPSYSMEM_IOC_MAGIC, 3, struct message_send_request)
+#define CHANGE_MAX_MESSAGE_SIZE _IO(OPSYSMEM_IOC_MAGIC, 4) /* Parameter is the largest message accepted, up to 1MiB */
+#define GET_STATS _IOR(OPSYSMEM_IOC_MAGIC, 5, struct message_queue_stats)
+#define CHANGE_MAX_MESSAGES_COUNT _IO(OPSYSMEM_IOC_MAGIC, 6) /* Parameter is the most messages the queue holds; 0 for no limit */
+#define CHANGE_PRODUCER_QUOTA _IO(OPSYSMEM_IOC_MAGIC, 7) /* Parameter is the most footprint messages written on this file may have queued; 0 for no limit. Bigger messages fail with EMSGSIZE */
+#define SET_RATE_LIMIT _IOW(OPSYSMEM_IOC_MAGIC, 8, struct message_rate_limit) /* For writes on this file */
+#define CHANGE_MESSAGE_TTL _IO(OPSYSMEM_IOC_MAGIC, 9) /* Parameter is how many milliseconds messages written on this file live; 0 for ever */
+#define SEND_MESSAGE_TTL _IOW(OPSYSMEM_IOC_MAGIC, 10, struct message_send_ttl_request)
+#define SEND_MESSAGE_DELAYED _IOW(OPSYSMEM_IOC_MAGIC, 11, struct message_send_delayed_request)
+#define RECEIVE_MESSAGE _IOWR(OPSYSMEM_IOC_MAGIC, 12, struct message_receive_request)
+#define ACK_MESSAGE _IOW(OPSYSMEM_IOC_MAGIC, 13, __u64) /* Parameter is a pointer to the receipt of a received message, which is then removed */
+#define CHANGE_VISIBILITY_TIMEOUT _IO(OPSYSMEM_IOC_MAGIC, 14) /* Parameter is how many milliseconds received messages wait for ACK_MESSAGE, up to 12 hours */
+#define READ_DEAD_LETTER _IOW(OPSYSMEM_IOC_MAGIC, 15, struct message_read_request)
+#define CHANGE_MAX_DELIVERIES _IO(OPSYSMEM_IOC_MAGIC, 16) /* Parameter is how many times RECEIVE_MESSAGE hands a message out, up to 255; 0 for no limit */
+#define CHANGE_DEAD_LETTERS_SIZE _IO(OPSYSMEM_IOC_MAGIC, 17) /* Like CHANGE_MAX_MESSAGES_SIZE, for the dead letter queue */
+#define BEGIN_TRANSACTION _IOW(OPSYSMEM_IOC_MAGIC, 18, struct message_transaction_request)
+#define COMMIT_TRANSACTION _IO(OPSYSMEM_IOC_MAGIC, 19) /* Makes the messages written since BEGIN_TRANSACTION readable, all at once */
+#define ABORT_TRANSACTION _IO(OPSYSMEM_IOC_MAGIC, 20) /* Throws away the messages written since BEGIN_TRANSACTION */
+#define CALL_MESSAGE _IOWR(OPSYSMEM_IOC_MAGIC, 21, struct message_call_request)
+#define READ_CALL _IOWR(OPSYSMEM_IOC_MAGIC, 22, struct message_call_read_request)
+#define SEND_REPLY _IOW(OPSYSMEM_IOC_MAGIC, 23, struct message_reply_request)
+#define READ_REPLY _IOWR(OPSYSMEM_IOC_MAGIC, 24, struct message_call_read_request)
+#define CHANGE_MESSAGE_TYPE _IO(OPSYSMEM_IOC_MAGIC, 25) /* Parameter is the type of messages written on this file, below MESSAGE_TYPES */
+#define READ_MESSAGE_TYPE _IOWR(OPSYSMEM_IOC_MAGIC, 26, struct message_type_read_request)
+
+/* Queue modes */
+#define QUEUE_MODE_FIFO 0 /* Every message is read once and then removed */
+/*
+ * Messages are kept until the queue limits force the oldest ones out.
+ * Every reader consumes from its own file position, which is the sequence
+ * number of the next message it will read; lseek moves it to any retained one.
+ */
+#define QUEUE_MODE_LOG 1
+/*
+ * Messages are read highest priority first and in FIFO order within a
+ * priority. The mode can only be entered or left while the queue is empty.
+ */
+#define QUEUE_MODE_PRIORITY 2
+/*
+ * Every open file is a producer with its own list of messages. Readers take
+ * from the producers in deficit round robin, so each producer with messages
+ * gets the same share of bytes whatever the others write. The mode can only
+ * be entered or left while the queue is empty.
+ */
+#define QUEUE_MODE_FAIR 3
+/*
+ * Flight recorder: reads are destructive like FIFO, but a write that does
+ * not fit evicts the oldest messages instead of failing or sleeping, so the
+ * newest data is always kept. Evicted messages are counted as overruns.
+ */
+#define QUEUE_MODE_RING 4
+/*
+ * Blocking driver only. The queue holds nothing: a write sleeps until a read
+ * has copied the message straight out of the buffer of the writer, so a
+ * writer never runs ahead of the readers. Calls, delayed messages,
+ * transactions and RECEIVE_MESSAGE are refused. The mode can only be entered
+ * while the queue is empty, and left while no writer is waiting.
+ */
+#define QUEUE_MODE_RENDEZVOUS 5
+/*
+ * Messages carry the type of the file that wrote them, set with
+ * CHANGE_MESSAGE_TYPE, and each type is kept in its own list. read() takes
+ * the oldest message of any type; READ_MESSAGE_TYPE takes the oldest of one
+ * type, or of the lowest type up to one, without going past the others.
+ * The mode can only be entered or left while the queue is empty.
+ */
+#define QUEUE_MODE_TYPED 6
+
+#define MESSAGE_PRIORITY_LEVELS 32 /* Priorities go from 0 (lowest, default) to 31 */
+#define MESSAGE_TYPES 32 /* Types go from 0 (default) to 31 */
+
+/* Struct passed to SEND_MESSAGE; returns the number of bytes written like write() */
+struct message_send_request {
+
+    __u64 message; /* Pointer to the message */
+    __u64 message_size;
+    __u32 priority;
+    __u32 padding; /* Unused, keeps the struct the same size for 32 bit programs */
+};
+
+/*
+ * Struct passed to SEND_MESSAGE_TTL, like SEND_MESSAGE with the time to live
+ * of this message instead of the one of the file. Once it is over the message
+ * is never read and its space is freed within EXPIRY_REAP_INTERVAL.
+ */
+struct message_send_ttl_request {
+
+    __u64 message; /* Pointer to the message */
+    __u64 message_size;
+    __u64 ttl_ms; /* 0 for ever */
+    __u32 priority;
+    __u32 padding; /* Unused */
+};
+
+/*
+ * Struct passed to SEND_MESSAGE_DELAYED, like SEND_MESSAGE_TTL with a time
+ * before which the message cannot be read. The message takes its room in the
+ * queue when it is sent and is appended to it once due, within a few
+ * milliseconds. Its time to live starts then. A time already past sends it
+ * at once; one more than 30 days ahead is refused with EINVAL.
+ */
+struct message_send_delayed_request {
+
+    __u64 message; /* Pointer to the message */
+    __u64 message_size;
+    __u64 ttl_ms; /* 0 for ever */
+    __u64 not_before_ns; /* CLOCK_MONOTONIC time, as from clock_gettime */
+    __u32 priority;
+    __u32 padding; /* Unused */
+};
+
+/*
+ * Struct passed to RECEIVE_MESSAGE, which reads like read() but does not
+ * remove the message: it is kept aside under a receipt until ACK_MESSAGE is
+ * called with it. If that does not happen within the visibility timeout the
+ * message goes back to the front of the queue and is read again, under a new
+ * receipt, so a reader that dies loses nothing. Log mode refuses it.
+ */
+struct message_receive_request {
+
+    __u64 buffer; /* Pointer to the buffer */
+    __u64 buffer_size;
+    __u64 receipt; /* Filled in */
+};
+
+/*
+ * Struct passed to READ_DEAD_LETTER, which removes the oldest message of the
+ * dead letter queue and returns its length like read(), or fails with EAGAIN.
+ * Messages whose time to live is over, and received messages that time out
+ * after their CHANGE_MAX_DELIVERIES reception, go there instead of being
+ * lost, as long as they fit in its own size limit.
+ */
+struct message_read_request {
+
+    __u64 buffer; /* Pointer to the buffer */
+    __u64 buffer_size;
+};
+
+/*
+ * Struct passed to READ_MESSAGE_TYPE, which removes the oldest message of
+ * the type and returns its length like read(). With lowest set it takes the
+ * oldest message of the lowest type up to type instead, like a negative type
+ * given to msgrcv. The blocking driver sleeps until there is one; the other
+ * fails with EAGAIN. Only typed mode accepts it.
+ */
+struct message_type_read_request {
+
+    __u64 buffer; /* Pointer to the buffer */
+    __u64 buffer_size;
+    __u32 type;
+    __u32 lowest;
+    __u32 read_type; /* Filled in with the type of the message read */
+    __u32 padding; /* Unused */
+};
+
+/*
+ * Struct passed to BEGIN_TRANSACTION. Until the transaction commits or aborts,
+ * messages written on the file are held back, and readers see all of them or
+ * none. Room for max_messages messages taking max_size bytes of memory, as
+ * CHANGE_MAX_MESSAGES_SIZE counts it, is reserved up front: it fails with
+ * EAGAIN if the queue does not have it now, without waiting, or with EINVAL if
+ * it is more than the limits allow at all. Writes going beyond it fail with
+ * ENOSPC. SEND_MESSAGE_DELAYED fails with EINVAL inside a
+ * transaction, and the queue mode cannot change while one is open. Closing
+ * the file aborts it.
+ */
+struct message_transaction_request {
+
+    __u64 max_messages;
+    __u64 max_size;
+};
+
+/*
+ * Struct passed to CALL_MESSAGE, which sends a message like SEND_MESSAGE
+ * under a new correlation ID. Its reader gets the ID from READ_CALL and
+ * answers with SEND_REPLY, which hands the reply straight to the calling
+ * file, to be read there with READ_REPLY. A call whose message leaves the
+ * queue any other way, read with read(), evicted, expired, moved to the dead
+ * letter queue or aborted with its transaction, can never be answered: its
+ * READ_REPLY fails with ECANCELED instead, telling its ID.
+ */
+struct message_call_request {
+
+    __u64 message; /* Pointer to the message */
+    __u64 message_size;
+    __u32 priority;
+    __u32 correlation_id; /* Filled in */
+};
+
+/*
+ * Struct passed to READ_CALL, which reads from the queue like read(), and to
+ * READ_REPLY, which reads the oldest reply to a call of the file. The ID is
+ * 0 for a message read with READ_CALL that is not a call. READ_REPLY fails
+ * with EINVAL if the file has neither replies nor calls waiting for one.
+ * The blocking driver waits for a reply up to timeout_ms, then fails with
+ * ETIMEDOUT; the call still waits for its reply.
+ */
+struct message_call_read_request {
+
+    __u64 buffer; /* Pointer to the buffer */
+    __u64 buffer_size;
+    __u32 correlation_id; /* Filled in */
+    __u32 timeout_ms; /* READ_REPLY only; 0 for 30 seconds, up to 12 hours */
+};
+
+/*
+ * Struct passed to SEND_REPLY. It fails with EINVAL if no call with the ID
+ * waits for a reply: a call gets one reply, and none once its file is closed.
+ * Until it is read the reply takes room in the queue as a message would, so
+ * when there is none the non-blocking driver fails with EAGAIN and the
+ * blocking driver sleeps.
+ */
+struct message_reply_request {
+
+    __u64 message; /* Pointer to the message */
+    __u64 message_size;
+    __u32 correlation_id;
+    __u32 padding; /* Unused */
+};
+
+/*
+ * Struct passed to SET_RATE_LIMIT. Writes on the file take their length from
+ * a bucket of bytes and one from a bucket of messages, each refilled at its
+ * rate up to its burst. A rate of 0 removes that limit. When a bucket is short
+ * the non-blocking driver returns EAGAIN and the blocking driver sleeps.
+ */
+struct message_rate_limit {
+
+    __u64 bytes_per_second;
+    __u64 burst_bytes;
+    __u64 messages_per_second;
+    __u64 burst_messages;
+};
+
+/*
+ * Struct filled by GET_STATS; the same values are in /sys/kernel/<module>/stats.
+ * Event counters count since the module was loaded. The rest describe the
+ * queue now and its largest size so far. The footprint is the memory the
+ * messages really take: payload rounded up by the allocator plus the
+ * structures kept for every message. It is what CHANGE_MAX_MESSAGES_SIZE limits.
+ */
+struct message_queue_stats {
+
+    __u64 messages_enqueued;
+    __u64 bytes_enqueued;
+    __u64 messages_dequeued;
+    __u64 bytes_dequeued;
+    __u64 log_reads; /* Messages copied by log mode readers */
+    __u64 messages_evicted; /* Messages dropped to make room in log mode */
+    __u64 rejected_eagain;
+    __u64 rejected_einval;
+    __u64 rejected_efault;
+    __u64 allocation_failures;
+    __u64 blocked_reads; /* Reads that had to sleep (blocking driver) */
+    __u64 blocked_writes; /* Writes that had to sleep (blocking driver) */
+    __u64 messages_count;
+    __u64 messages_size;
+    __u64 high_water_count;
+    __u64 high_water_size;
+    __u64 messages_footprint;
+    __u64 high_water_footprint;
+    __u64 throttled_writes; /* Writes refused or delayed by SET_RATE_LIMIT */
+    __u64 messages_overrun; /* Messages dropped unread to make room in ring mode */
+    __u64 messages_expired; /* Messages dropped unread once their time to live was over */
+    __u64 messages_delayed; /* Messages sent with SEND_MESSAGE_DELAYED that were not due yet */
+    __u64 messages_acked; /* Received messages removed by ACK_MESSAGE */
+    __u64 messages_redelivered; /* Received messages put back after their visibility timeout */
+    __u64 messages_dead_lettered; /* Messages moved to the dead letter queue, which counts them as enqueued again */
+    __u64 dead_letters_dropped; /* Messages lost because the dead letter queue was full */
+    __u64 dead_letters_count; /* Messages in the dead letter queue now */
+    __u64 transactions_committed;
+    __u64 transactions_aborted; /* Including those still open when their file was closed */
+    __u64 calls_sent;
+    __u64 replies_sent;
+    __u64 replies_refused; /* Replies to calls that were not waiting for one */
+    __u64 rendezvous_handoffs; /* Messages a reader took straight from a writer */
+};
+
+#endif
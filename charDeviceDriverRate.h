@@ -0,0 +1,160 @@
+/**
+ * @file charDeviceDriverRate.h
+ * @author Alexandru Blinda
+ * @date 6 November 2017
+ * @version 0.1
+ * @brief Header file that defines the token buckets limiting how fast a file writes.
+ * Every file has one bucket for bytes and one for messages, set with
+ * SET_RATE_LIMIT. A write takes its length from the first and one from the
+ * second; the drivers either refuse it or sleep until both hold enough.
+ * Part of exercise 3 for Operating Systems Module (creating a character device
+ * driver).
+ */
+#ifndef CHARDEVICEDRIVERRATE_H
+#define CHARDEVICEDRIVERRATE_H
+
+#include <linux/spinlock.h> /* The buckets of a file can be used by several writers at once */
+#include <linux/ktime.h> /* ktime_get and ktime_t */
+
+#define RATE_LIMIT_MAX_BURST 4294967295UL /* Keeps burst * NSEC_PER_SEC within 64 bits */
+
+/*
+ * Struct to hold one token bucket. Tokens are kept in billionths so a refill
+ * of any number of nanoseconds adds a whole number of them. A message bigger
+ * than the burst is let through once the bucket is full and leaves it in debt.
+ */
+struct token_bucket {
+
+    unsigned long rate; /* Tokens per second; 0 for no limit */
+    unsigned long burst; /* Most tokens the bucket holds */
+    s64 tokens; /* Times NSEC_PER_SEC; negative while in debt */
+    ktime_t last_refill;
+};
+
+/* Struct to hold the rate limit of one file */
+struct message_rate_state {
+
+    spinlock_t lock;
+    struct token_bucket bytes;
+    struct token_bucket messages;
+};
+
+/* Starts a bucket full with the given limit */
+static void init_token_bucket(struct token_bucket* bucketp, unsigned long rate, unsigned long burst) {
+
+    bucketp->rate = rate;
+    bucketp->burst = burst;
+    bucketp->tokens = (s64) burst * NSEC_PER_SEC;
+    bucketp->last_refill = ktime_get();
+}
+
+/* Adds the tokens earned since the last refill, up to the burst */
+static void refill_token_bucket(struct token_bucket* bucketp, ktime_t now) {
+
+    s64 full = (s64) bucketp->burst * NSEC_PER_SEC;
+    s64 elapsed = ktime_to_ns(ktime_sub(now, bucketp->last_refill));
+    bucketp->last_refill = now;
+    if(bucketp->tokens >= full || elapsed <= 0) {
+
+        return;
+    }
+
+    /* Long idle periods fill the bucket without multiplying huge numbers */
+    u64 missing = full - bucketp->tokens;
+    if((u64) elapsed >= div64_u64(missing, bucketp->rate) + 1) {
+
+        bucketp->tokens = full;
+    } else {
+
+        bucketp->tokens += elapsed * bucketp->rate;
+    }
+}
+
+/* Returns how many nanoseconds pass before the bucket allows cost tokens, 0 if it does now */
+static s64 token_bucket_wait(struct token_bucket* bucketp, unsigned long cost) {
+
+    if(bucketp->rate == 0) {
+
+        return 0;
+    }
+
+    s64 needed = (s64) min_t(unsigned long, cost, bucketp->burst) * NSEC_PER_SEC;
+    if(bucketp->tokens >= needed) {
+
+        return 0;
+    }
+    return div64_u64(needed - bucketp->tokens + bucketp->rate - 1, bucketp->rate);
+}
+
+static void init_rate_state(struct message_rate_state* ratep) {
+
+    spin_lock_init(&ratep->lock);
+    init_token_bucket(&ratep->bytes, 0, 0);
+    init_token_bucket(&ratep->messages, 0, 0);
+}
+
+/* Replaces the limits of a file; both buckets start full. Returns -EINVAL for limits that cannot work */
+static int set_rate_limit(struct message_rate_state* ratep, const struct message_rate_limit* limitp) {
+
+    if((limitp->bytes_per_second != 0 && (limitp->burst_bytes == 0 || limitp->burst_bytes > RATE_LIMIT_MAX_BURST))
+            || (limitp->messages_per_second != 0 && (limitp->burst_messages == 0 || limitp->burst_messages > RATE_LIMIT_MAX_BURST))) {
+
+        return -EINVAL;
+    }
+
+    spin_lock(&ratep->lock);
+    init_token_bucket(&ratep->bytes, limitp->bytes_per_second, limitp->burst_bytes);
+    init_token_bucket(&ratep->messages, limitp->messages_per_second, limitp->burst_messages);
+    spin_unlock(&ratep->lock);
+    return 0;
+}
+
+/*
+ * Takes the tokens of a message of the given length from both buckets.
+ * Returns 0 if they were taken, or the nanoseconds to wait before trying
+ * again, in which case nothing was taken.
+ */
+static s64 take_rate_tokens(struct message_rate_state* ratep, size_t length) {
+
+    spin_lock(&ratep->lock);
+    if(ratep->bytes.rate == 0 && ratep->messages.rate == 0) {
+
+        spin_unlock(&ratep->lock);
+        return 0;
+    }
+
+    ktime_t now = ktime_get();
+    refill_token_bucket(&ratep->bytes, now);
+    refill_token_bucket(&ratep->messages, now);
+    s64 wait_ns = max_t(s64, token_bucket_wait(&ratep->bytes, length), token_bucket_wait(&ratep->messages, 1));
+    if(wait_ns == 0) {
+
+        if(ratep->bytes.rate != 0) {
+
+            ratep->bytes.tokens -= (s64) length * NSEC_PER_SEC;
+        }
+        if(ratep->messages.rate != 0) {
+
+            ratep->messages.tokens -= NSEC_PER_SEC;
+        }
+    }
+    spin_unlock(&ratep->lock);
+    return wait_ns;
+}
+
+/* Gives back the tokens of a message that was not written after all */
+static void return_rate_tokens(struct message_rate_state* ratep, size_t length) {
+
+    spin_lock(&ratep->lock);
+    if(ratep->bytes.rate != 0) {
+
+        ratep->bytes.tokens = min_t(s64, ratep->bytes.tokens + (s64) length * NSEC_PER_SEC, (s64) ratep->bytes.burst * NSEC_PER_SEC);
+    }
+    if(ratep->messages.rate != 0) {
+
+        ratep->messages.tokens = min_t(s64, ratep->messages.tokens + NSEC_PER_SEC, (s64) ratep->messages.burst * NSEC_PER_SEC);
+    }
+    spin_unlock(&ratep->lock);
+}
+
+#endif
@@ -0,0 +1,214 @@
+/**
+ * @file charDeviceDriverRendezvous.h
+ * @author Alexandru Blinda
+ * @date 6 November 2017
+ * @version 0.1
+ * @brief Header file that defines the hand-off of rendezvous mode.
+ * In rendezvous mode the queue holds nothing. A writer pins the pages of its
+ * own buffer, offers them and sleeps; a reader takes the oldest offer, copies
+ * the message straight out of those pages and wakes the writer. Offers are
+ * kept in the queue, under its lock, so a mode change sees every waiting
+ * writer. A writer that is killed takes its offer back, unless a reader is
+ * copying it, which the writer then waits for as its buffer is in use.
+ * Only the blocking driver has this mode, as a writer always has to wait.
+ * Include it after messageQueue.c.
+ * Part of exercise 3 for Operating Systems Module (creating a character device
+ * driver).
+ */
+#ifndef CHARDEVICEDRIVERRENDEZVOUS_H
+#define CHARDEVICEDRIVERRENDEZVOUS_H
+
+#include <linux/completion.h> /* A writer sleeps until its message is taken */
+#include <linux/highmem.h> /* kmap_local_page for the pinned pages */
+
+/* Struct to hold the message of a sleeping writer; it lives on the stack of the writer */
+struct rendezvous_offer {
+
+    struct page** pages; /* The buffer of the writer, pinned */
+    unsigned long page_count;
+    unsigned long offset; /* Where the message starts in the first page */
+    size_t length;
+    struct completion taken; /* Completed once no reader will look at it any more */
+    int claimed; /* A reader took it out of the list and is copying it; protected by the queue lock */
+    int cancelled; /* Its writer was killed while it was claimed; protected by the queue lock */
+    int delivered; /* A reader copied it; set before completing taken */
+    struct rendezvous_offer* next;
+};
+
+/* Pins the user buffer of a message for an offer. Returns -ENOMEM or -EFAULT if it cannot. */
+static int pin_offer(struct rendezvous_offer* offer, const char* buffer, size_t length) {
+
+    offer->offset = offset_in_page(buffer);
+    offer->page_count = DIV_ROUND_UP(offer->offset + length, PAGE_SIZE);
+    offer->length = length;
+    offer->pages = NULL;
+    offer->next = NULL;
+    offer->claimed = offer->cancelled = offer->delivered = 0;
+    init_completion(&offer->taken);
+    if(length == 0) {
+
+        offer->page_count = 0;
+        return 0;
+    }
+
+    offer->pages = (struct page**) kcalloc(offer->page_count, sizeof(struct page*), GFP_KERNEL);
+    if(offer->pages == NULL) {
+
+        return -ENOMEM;
+    }
+    /* Only read through, so no FOLL_WRITE */
+    int pinned = pin_user_pages_fast((unsigned long) buffer, offer->page_count, 0, offer->pages);
+    if(pinned != offer->page_count) {
+
+        if(pinned > 0) {
+
+            unpin_user_pages(offer->pages, pinned);
+        }
+        kfree(offer->pages);
+        return -EFAULT;
+    }
+    return 0;
+}
+
+static void unpin_offer(struct rendezvous_offer* offer) {
+
+    if(offer->pages != NULL) {
+
+        unpin_user_pages(offer->pages, offer->page_count);
+        kfree(offer->pages);
+    }
+}
+
+/*
+ * Adds an offer after the others, unless the device left rendezvous mode,
+ * in which case it returns -EAGAIN and the message should be queued instead.
+ */
+static int post_offer(struct message_queue* queuep, struct rendezvous_offer* offer) {
+
+    lock_queue(queuep, LOCK_SITE_RENDEZVOUS);
+    if(queuep->mode != QUEUE_MODE_RENDEZVOUS) {
+
+        unlock_queue(queuep);
+        return -EAGAIN;
+    }
+    if(queuep->offers_rear == NULL) {
+
+        queuep->offers_head = queuep->offers_rear = offer;
+    } else {
+
+        queuep->offers_rear->next = offer;
+        queuep->offers_rear = offer;
+    }
+    unlock_queue(queuep);
+    return 0;
+}
+
+/*
+ * Removes the oldest offer, or returns NULL. An offer given back with
+ * return_offer is first again. Sets *open to whether the device is still in
+ * rendezvous mode, as a reader waiting for offers must stop waiting if not.
+ */
+static struct rendezvous_offer* take_offer(struct message_queue* queuep, int* open) {
+
+    lock_queue(queuep, LOCK_SITE_RENDEZVOUS);
+    struct rendezvous_offer* offer = queuep->offers_head;
+    if(offer != NULL) {
+
+        queuep->offers_head = offer->next;
+        if(queuep->offers_head == NULL) {
+
+            queuep->offers_rear = NULL;
+        }
+        offer->next = NULL;
+        offer->claimed = 1;
+    }
+    *open = queuep->mode == QUEUE_MODE_RENDEZVOUS;
+    unlock_queue(queuep);
+    return offer;
+}
+
+/*
+ * Puts back first an offer a reader could not take, e.g. because its buffer
+ * was bad. If its writer was killed meanwhile, the writer is woken instead.
+ */
+static void return_offer(struct message_queue* queuep, struct rendezvous_offer* offer) {
+
+    lock_queue(queuep, LOCK_SITE_RENDEZVOUS);
+    offer->claimed = 0;
+    if(offer->cancelled) {
+
+        unlock_queue(queuep);
+        complete(&offer->taken);
+        return;
+    }
+    offer->next = queuep->offers_head;
+    queuep->offers_head = offer;
+    if(queuep->offers_rear == NULL) {
+
+        queuep->offers_rear = offer;
+    }
+    unlock_queue(queuep);
+}
+
+/* Hands the message of a claimed offer over; its writer may unpin it once woken */
+static void deliver_offer(struct rendezvous_offer* offer) {
+
+    offer->delivered = 1;
+    complete(&offer->taken);
+}
+
+/*
+ * Called by a writer that was killed while waiting. Takes its offer out of
+ * the list and returns 1, or returns 0 if a reader has claimed it, in which
+ * case that reader completes it once done with the pages.
+ */
+static int withdraw_offer(struct message_queue* queuep, struct rendezvous_offer* offer) {
+
+    lock_queue(queuep, LOCK_SITE_RENDEZVOUS);
+    if(offer->claimed) {
+
+        offer->cancelled = 1;
+        unlock_queue(queuep);
+        return 0;
+    }
+
+    struct rendezvous_offer** link = &queuep->offers_head;
+    struct rendezvous_offer* previous = NULL;
+    while(*link != offer) {
+
+        previous = *link;
+        link = &previous->next;
+    }
+    *link = offer->next;
+    if(queuep->offers_rear == offer) {
+
+        queuep->offers_rear = previous;
+    }
+    unlock_queue(queuep);
+    return 1;
+}
+
+/* Copies the message of an offer to the user, cut to length like copy_message_to_user. Returns the bytes copied or -EFAULT. */
+static ssize_t copy_offer_to_user(struct rendezvous_offer* offer, char* buffer, size_t length) {
+
+    size_t tmp_length = min(length, offer->length);
+    size_t copied = 0;
+    unsigned long offset = offer->offset;
+    unsigned long i;
+    for(i = 0; copied < tmp_length; i++) {
+
+        size_t chunk_length = min_t(size_t, PAGE_SIZE - offset, tmp_length - copied);
+        char* chunk = kmap_local_page(offer->pages[i]);
+        unsigned long not_copied = copy_to_user(buffer + copied, chunk + offset, chunk_length);
+        kunmap_local(chunk);
+        if(not_copied != 0) {
+
+            return -EFAULT;
+        }
+        copied += chunk_length;
+        offset = 0;
+    }
+    return copied;
+}
+
+#endif
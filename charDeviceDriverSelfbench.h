@@ -0,0 +1,242 @@
+/**
+ * @file charDeviceDriverSelfbench.h
+ * @author Alexandru Blinda
+ * @date 6 November 2017
+ * @version 0.1
+ * @brief Header file that defines the in-kernel benchmark of the queue.
+ * Writing "<threads> <milliseconds> <message size>" to
+ * /sys/kernel/debug/<module name>/selfbench starts that many kthreads which
+ * enqueue and dequeue on a private queue for that long, without any system
+ * call or copy to user space. Reading the file shows the last run.
+ * Include it after messageQueue.c.
+ * Part of exercise 3 for Operating Systems Module (creating a character device
+ * driver).
+ */
+#ifndef CHARDEVICEDRIVERSELFBENCH_H
+#define CHARDEVICEDRIVERSELFBENCH_H
+
+#include <linux/kthread.h> /* kthread_run */
+#include <linux/completion.h> /* Waiting for the kthreads to finish */
+
+#define SELFBENCH_MAX_THREADS 64
+#define SELFBENCH_MAX_DURATION_MS 60000
+
+/* Struct to hold what one kthread did; written only by that kthread */
+struct selfbench_thread {
+
+    struct message_queue* queuep;
+    unsigned long message_size;
+    ktime_t deadline;
+    unsigned long long iterations; /* One enqueue and one dequeue each */
+    unsigned long long enqueue_ns;
+    unsigned long long dequeue_ns;
+    unsigned long long alloc_ns; /* Allocating and freeing the message data */
+    int error;
+    struct completion done;
+};
+
+/* Struct to hold the result of the last run, shown by the selfbench file */
+struct selfbench_result {
+
+    unsigned int threads;
+    unsigned long duration_ms;
+    unsigned long message_size;
+    unsigned long long elapsed_ns;
+    unsigned long long operations; /* Enqueues and dequeues of all threads */
+    unsigned long long enqueue_ns;
+    unsigned long long dequeue_ns;
+    unsigned long long alloc_ns;
+    unsigned long long lock_contentions;
+    unsigned long long lock_wait_ns;
+    int error;
+};
+
+static DEFINE_MUTEX(selfbench_lock); /* One run at a time; also protects selfbench_last */
+static struct selfbench_result selfbench_last;
+
+/*
+ * Body of every kthread: enqueue and dequeue one message until the deadline.
+ * The messages go through the same enqueue and dequeue the drivers use, so
+ * they are also counted in the stats and traced like any other message.
+ */
+static int selfbench_thread_fn(void* arg) {
+
+    struct selfbench_thread* threadp = arg;
+    ktime_t now = ktime_get();
+
+    while(ktime_before(now, threadp->deadline)) {
+
+        struct message_queue_data* tmp_data = alloc_message_data(threadp->message_size);
+        ktime_t allocated = ktime_get();
+        if(tmp_data == NULL) {
+
+            threadp->error = -ENOMEM;
+            break;
+        }
+
+        if(enqueue(threadp->queuep, tmp_data, 0, 0, 0, 0, 0, NULL) != SUCCESS) {
+
+            free_message_data(tmp_data);
+            threadp->error = -ENOMEM;
+            break;
+        }
+        ktime_t enqueued = ktime_get();
+
+        /* Every thread enqueues before it dequeues, so the queue is never empty here */
+        tmp_data = dequeue(threadp->queuep);
+        ktime_t dequeued = ktime_get();
+        free_message_data(tmp_data);
+        ktime_t freed = ktime_get();
+
+        threadp->iterations++;
+        threadp->alloc_ns += ktime_to_ns(ktime_sub(allocated, now)) + ktime_to_ns(ktime_sub(freed, dequeued));
+        threadp->enqueue_ns += ktime_to_ns(ktime_sub(enqueued, allocated));
+        threadp->dequeue_ns += ktime_to_ns(ktime_sub(dequeued, enqueued));
+        now = freed;
+        cond_resched();
+    }
+
+    /* Do not return into the module after waking the writer; it may be unloaded */
+    kthread_complete_and_exit(&threadp->done, 0);
+}
+
+/* Runs the benchmark and fills resultp. Must be called with selfbench_lock held. */
+static int run_selfbench(unsigned int threads, unsigned long duration_ms, unsigned long message_size, struct selfbench_result* resultp) {
+
+    struct selfbench_thread* threadsp = (struct selfbench_thread*) kcalloc(threads, sizeof(struct selfbench_thread), GFP_KERNEL);
+    struct message_queue* benchq = initialise_queue();
+    if(threadsp == NULL || benchq == NULL) {
+
+        kfree(threadsp);
+        release_queue(benchq);
+        return -ENOMEM;
+    }
+    benchq->max_messages_size = ULONG_MAX; /* Only the queue operations are measured, never a full queue */
+
+    memset(resultp, 0, sizeof(*resultp));
+    resultp->threads = threads;
+    resultp->duration_ms = duration_ms;
+    resultp->message_size = message_size;
+
+    ktime_t start = ktime_get();
+    ktime_t deadline = ktime_add_ms(start, duration_ms);
+    unsigned int started;
+    for(started = 0; started < threads; started++) {
+
+        struct selfbench_thread* threadp = &threadsp[started];
+        threadp->queuep = benchq;
+        threadp->message_size = message_size;
+        threadp->deadline = deadline;
+        init_completion(&threadp->done);
+
+        struct task_struct* task = kthread_run(selfbench_thread_fn, threadp, "%s_bench/%u", DEVICE_NAME, started);
+        if(IS_ERR(task)) {
+
+            resultp->error = PTR_ERR(task);
+            break;
+        }
+    }
+
+    unsigned int i;
+    for(i = 0; i < started; i++) {
+
+        wait_for_completion(&threadsp[i].done);
+        resultp->operations += 2 * threadsp[i].iterations;
+        resultp->enqueue_ns += threadsp[i].enqueue_ns;
+        resultp->dequeue_ns += threadsp[i].dequeue_ns;
+        resultp->alloc_ns += threadsp[i].alloc_ns;
+        if(resultp->error == 0) {
+
+            resultp->error = threadsp[i].error;
+        }
+    }
+    resultp->elapsed_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    resultp->lock_contentions = benchq->lock_contentions;
+    resultp->lock_wait_ns = benchq->lock_wait_ns;
+
+    release_queue(benchq);
+    kfree(threadsp);
+    return resultp->error;
+}
+
+/* Per operation averages; the threads ran concurrently, so elapsed time counts once per thread */
+static int selfbench_show(struct seq_file* m, void* v) {
+
+    mutex_lock(&selfbench_lock);
+    struct selfbench_result* resultp = &selfbench_last;
+    if(resultp->threads == 0) {
+
+        seq_puts(m, "No run yet; write \"<threads> <milliseconds> <message size>\" to start one\n");
+        mutex_unlock(&selfbench_lock);
+        return 0;
+    }
+
+    unsigned long long operations = resultp->operations > 0 ? resultp->operations : 1;
+    unsigned long long iterations = operations / 2 > 0 ? operations / 2 : 1;
+    seq_printf(m, "threads: %u\n", resultp->threads);
+    seq_printf(m, "duration_ms: %lu\n", resultp->duration_ms);
+    seq_printf(m, "message_size: %lu\n", resultp->message_size);
+    seq_printf(m, "error: %d\n", resultp->error);
+    seq_printf(m, "operations: %llu\n", resultp->operations);
+    seq_printf(m, "ns_per_op: %llu\n", div64_u64(resultp->elapsed_ns * resultp->threads, operations));
+    seq_printf(m, "enqueue_ns_per_op: %llu\n", div64_u64(resultp->enqueue_ns, iterations));
+    seq_printf(m, "dequeue_ns_per_op: %llu\n", div64_u64(resultp->dequeue_ns, iterations));
+    seq_printf(m, "lock_wait_ns_per_op: %llu\n", div64_u64(resultp->lock_wait_ns, operations));
+    seq_printf(m, "lock_contentions: %llu\n", resultp->lock_contentions);
+    seq_printf(m, "allocator_ns_per_op: %llu\n", div64_u64(resultp->alloc_ns, operations));
+    mutex_unlock(&selfbench_lock);
+    return 0;
+}
+
+static int selfbench_open(struct inode* inodep, struct file* filep) {
+
+    return single_open(filep, selfbench_show, NULL);
+}
+
+/* Starts a run and returns once it is over */
+static ssize_t selfbench_write(struct file* filep, const char* buffer, size_t length, loff_t* offset) {
+
+    char input[64];
+    unsigned int threads;
+    unsigned long duration_ms;
+    unsigned long message_size;
+
+    if(length >= sizeof(input)) {
+
+        return -EINVAL;
+    }
+    if(copy_from_user(input, buffer, length) != 0) {
+
+        return -EFAULT;
+    }
+    input[length] = '\0';
+
+    if(sscanf(input, "%u %lu %lu", &threads, &duration_ms, &message_size) != 3
+            || threads == 0 || threads > SELFBENCH_MAX_THREADS
+            || duration_ms == 0 || duration_ms > SELFBENCH_MAX_DURATION_MS
+            || message_size == 0 || message_size > MAX_MESSAGE_SIZE_LIMIT) {
+
+        return -EINVAL;
+    }
+
+    if(mutex_lock_interruptible(&selfbench_lock) != 0) {
+
+        return -EINTR;
+    }
+    int error = run_selfbench(threads, duration_ms, message_size, &selfbench_last);
+    mutex_unlock(&selfbench_lock);
+
+    printk(KERN_INFO "%s: Self benchmark with %u threads finished with %d\n", PRINTING_NAME, threads, error);
+    return error < 0 ? error : length;
+}
+
+static const struct file_operations selfbench_fops = {
+	.owner = THIS_MODULE,
+	.open = selfbench_open,
+	.read = seq_read,
+	.write = selfbench_write,
+	.llseek = seq_lseek,
+	.release = single_release
+};
+
+#endif
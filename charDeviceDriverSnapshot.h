@@ -0,0 +1,125 @@
+/**
+ * @file charDeviceDriverSnapshot.h
+ * @author Alexandru Blinda
+ * @date 6 November 2017
+ * @version 0.1
+ * @brief Header file that defines the snapshot of the queue in debugfs.
+ * Reading /sys/kernel/debug/<module name>/snapshot lists every queued message,
+ * in the order readers would get them, without dequeuing anything. Each line
+ * has the sequence, priority, size, age and the first snapshot_payload_bytes
+ * bytes of the message in hex.
+ * The queue lock is only held while one buffer of lines is filled, so writers
+ * and readers carry on while a large queue is listed. Messages read meanwhile
+ * are left out and messages written meanwhile may show up.
+ * Include it after messageQueue.c.
+ * Part of exercise 3 for Operating Systems Module (creating a character device
+ * driver).
+ */
+#ifndef CHARDEVICEDRIVERSNAPSHOT_H
+#define CHARDEVICEDRIVERSNAPSHOT_H
+
+#define SNAPSHOT_MAX_PAYLOAD_BYTES 64 /* The most %*ph prints */
+
+static u32 snapshot_payload_bytes = 16; /* Set through debugfs */
+
+/* Struct kept in the seq_file of every open snapshot file */
+struct snapshot_iterator {
+
+    struct message_queue* queuep;
+    struct message_queue_walk walk;
+    int started; /* Whether walk holds a position yet */
+    ktime_t now; /* Ages are taken against this */
+};
+
+/* Takes the lock for one buffer of lines; position 0 is the header */
+static void* snapshot_start(struct seq_file* m, loff_t* pos) {
+
+    struct snapshot_iterator* iter = m->private;
+    lock_queue(iter->queuep, LOCK_SITE_DEBUGFS);
+    iter->now = ktime_get();
+
+    if(*pos == 0) {
+
+        iter->started = 0;
+        return SEQ_START_TOKEN;
+    }
+    if(iter->started == 0) {
+
+        iter->started = 1;
+        return start_queue_walk(iter->queuep, &iter->walk);
+    }
+    return resume_queue_walk(iter->queuep, &iter->walk);
+}
+
+static void* snapshot_next(struct seq_file* m, void* v, loff_t* pos) {
+
+    struct snapshot_iterator* iter = m->private;
+    ++*pos;
+
+    if(v == SEQ_START_TOKEN) {
+
+        iter->started = 1;
+        return start_queue_walk(iter->queuep, &iter->walk);
+    }
+    return next_queue_walk(iter->queuep, &iter->walk);
+}
+
+static void snapshot_stop(struct seq_file* m, void* v) {
+
+    struct snapshot_iterator* iter = m->private;
+    unlock_queue(iter->queuep);
+}
+
+static int snapshot_show(struct seq_file* m, void* v) {
+
+    struct snapshot_iterator* iter = m->private;
+    if(v == SEQ_START_TOKEN) {
+
+        seq_puts(m, "sequence priority size age_ns payload\n");
+        return 0;
+    }
+
+    struct message_queue_node* tmp_node = v;
+    seq_printf(m, "%llu %u %lu %lld", tmp_node->sequence, tmp_node->priority, tmp_node->data->message_size,
+        ktime_to_ns(ktime_sub(iter->now, tmp_node->enqueue_time)));
+
+    /* Only the first chunk is printed; it is at least a page long unless the message is shorter */
+    unsigned long payload_bytes = min_t(unsigned long, snapshot_payload_bytes, SNAPSHOT_MAX_PAYLOAD_BYTES);
+    unsigned long chunk_length = 0;
+    char* chunk = payload_bytes > 0 ? message_chunk(tmp_node->data, 0, &chunk_length) : NULL;
+    chunk_length = min(chunk_length, tmp_node->data->message_size);
+    if(chunk != NULL && chunk_length > 0) {
+
+        seq_printf(m, " %*phN", (int) min(payload_bytes, chunk_length), chunk);
+    }
+    seq_putc(m, '\n');
+    return 0;
+}
+
+static const struct seq_operations snapshot_seq_ops = {
+	.start = snapshot_start,
+	.next = snapshot_next,
+	.stop = snapshot_stop,
+	.show = snapshot_show
+};
+
+static int snapshot_open(struct inode* inodep, struct file* filep) {
+
+    struct snapshot_iterator* iter = __seq_open_private(filep, &snapshot_seq_ops, sizeof(struct snapshot_iterator));
+    if(iter == NULL) {
+
+        return -ENOMEM;
+    }
+    iter->queuep = inodep->i_private;
+    return SUCCESS;
+}
+
+static const struct file_operations snapshot_fops = {
+	.owner = THIS_MODULE,
+	.open = snapshot_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = seq_release_private
+};
+
+#endif
@@ -0,0 +1,399 @@
+/**
+ * @file charDeviceDriverStats.h
+ * @author Alexandru Blinda
+ * @date 6 November 2017
+ * @version 0.1
+ * @brief Header file that defines the measurements shared by both drivers.
+ * Events and latencies are counted per CPU so recording one never touches a
+ * shared cache line; they are summed only when someone reads them.
+ * Part of exercise 3 for Operating Systems Module (creating a character device
+ * driver).
+ */
+#ifndef CHARDEVICEDRIVERSTATS_H
+#define CHARDEVICEDRIVERSTATS_H
+
+#include <linux/percpu.h> /* Per-CPU variables */
+#include <linux/ktime.h> /* ktime_get and ktime_t */
+#include <linux/log2.h> /* ilog2 */
+#include <linux/seq_file.h> /* seq_printf for debugfs files */
+#include <linux/debugfs.h> /* debugfs_create_dir, debugfs_create_file */
+#include <linux/kobject.h> /* kobject for the sysfs stats file */
+#include <linux/sysfs.h> /* sysfs_emit_at */
+#include <linux/jump_label.h> /* Static key switching the lock statistics on and off */
+#include <linux/cgroup.h> /* cgroup_id of the writer */
+
+#define LATENCY_BUCKETS 48 /* Bucket b counts latencies from 2^b to 2^(b+1) - 1 ns; the last one everything above */
+
+/* Struct to count latencies by power of two of nanoseconds */
+struct latency_histogram {
+
+    unsigned long buckets[LATENCY_BUCKETS];
+};
+
+/* Struct to count the events of the driver on one CPU */
+struct queue_counters {
+
+    unsigned long long messages_enqueued;
+    unsigned long long bytes_enqueued;
+    unsigned long long messages_dequeued;
+    unsigned long long bytes_dequeued;
+    unsigned long long log_reads;
+    unsigned long long messages_evicted;
+    unsigned long long rejected_eagain;
+    unsigned long long rejected_einval;
+    unsigned long long rejected_efault;
+    unsigned long long allocation_failures;
+    unsigned long long blocked_reads;
+    unsigned long long blocked_writes;
+    unsigned long long throttled_writes;
+    unsigned long long messages_overrun;
+    unsigned long long messages_expired;
+    unsigned long long messages_delayed;
+    unsigned long long messages_acked;
+    unsigned long long messages_redelivered;
+    unsigned long long messages_dead_lettered;
+    unsigned long long dead_letters_dropped;
+    unsigned long long transactions_committed;
+    unsigned long long transactions_aborted;
+    unsigned long long calls_sent;
+    unsigned long long replies_sent;
+    unsigned long long replies_refused;
+    unsigned long long rendezvous_handoffs;
+};
+
+/* Struct to measure the queue lock at one LOCK_SITE_* */
+struct lock_site_stats {
+
+    unsigned long long acquisitions;
+    unsigned long long contentions; /* Acquisitions that found the lock held */
+    unsigned long long wait_ns;
+    unsigned long long hold_ns;
+};
+
+/* Struct to measure the queue lock at every site on one CPU */
+struct lock_stats {
+
+    struct lock_site_stats sites[LOCK_SITES];
+};
+
+static const char* const lock_site_names[LOCK_SITES] = {
+    "release_queue", "enqueue", "dequeue", "is_queue_empty", "is_space_in_queue", "log", "device_ioctl", "debugfs",
+    "reap_expired", "promote_delayed", "ack", "rendezvous", "call"
+};
+
+static DEFINE_PER_CPU(struct latency_histogram, residency_histogram); /* Time messages spend in the queue */
+static DEFINE_PER_CPU(struct queue_counters, queue_counters);
+static DEFINE_PER_CPU(struct lock_stats, lock_stats);
+static DEFINE_STATIC_KEY_FALSE(lock_stats_key); /* Off unless enabled through the lock_stats debugfs file */
+static DEFINE_MUTEX(lock_stats_switch); /* Serialises writes to the lock_stats debugfs file */
+static struct dentry* debugfs_dir; /* /sys/kernel/debug/<module name> */
+static struct kobject* stats_kobj; /* /sys/kernel/<module name> */
+
+/* Counts a read or write that failed with the given error */
+static inline void count_reject(int error) {
+
+    if(error == -EAGAIN) {
+
+        this_cpu_inc(queue_counters.rejected_eagain);
+    } else if(error == -EINVAL) {
+
+        this_cpu_inc(queue_counters.rejected_einval);
+    } else if(error == -EFAULT) {
+
+        this_cpu_inc(queue_counters.rejected_efault);
+    }
+}
+
+/*
+ * Sums the counters of every CPU and adds the state of the queue.
+ * The queue fields are read without the queue lock, so they may be slightly stale.
+ */
+static void collect_stats(struct message_queue* queuep, struct message_queue_stats* stats) {
+
+    memset(stats, 0, sizeof(*stats));
+
+    int cpu;
+    for_each_possible_cpu(cpu) {
+
+        struct queue_counters* counters = per_cpu_ptr(&queue_counters, cpu);
+        stats->messages_enqueued += counters->messages_enqueued;
+        stats->bytes_enqueued += counters->bytes_enqueued;
+        stats->messages_dequeued += counters->messages_dequeued;
+        stats->bytes_dequeued += counters->bytes_dequeued;
+        stats->log_reads += counters->log_reads;
+        stats->messages_evicted += counters->messages_evicted;
+        stats->rejected_eagain += counters->rejected_eagain;
+        stats->rejected_einval += counters->rejected_einval;
+        stats->rejected_efault += counters->rejected_efault;
+        stats->allocation_failures += counters->allocation_failures;
+        stats->blocked_reads += counters->blocked_reads;
+        stats->blocked_writes += counters->blocked_writes;
+        stats->throttled_writes += counters->throttled_writes;
+        stats->messages_overrun += counters->messages_overrun;
+        stats->messages_expired += counters->messages_expired;
+        stats->messages_delayed += counters->messages_delayed;
+        stats->messages_acked += counters->messages_acked;
+        stats->messages_redelivered += counters->messages_redelivered;
+        stats->messages_dead_lettered += counters->messages_dead_lettered;
+        stats->dead_letters_dropped += counters->dead_letters_dropped;
+        stats->transactions_committed += counters->transactions_committed;
+        stats->transactions_aborted += counters->transactions_aborted;
+        stats->calls_sent += counters->calls_sent;
+        stats->replies_sent += counters->replies_sent;
+        stats->replies_refused += counters->replies_refused;
+        stats->rendezvous_handoffs += counters->rendezvous_handoffs;
+    }
+
+    stats->messages_count = READ_ONCE(queuep->messages_count);
+    stats->messages_size = READ_ONCE(queuep->messages_size);
+    stats->high_water_count = READ_ONCE(queuep->high_water_count);
+    stats->high_water_size = READ_ONCE(queuep->high_water_size);
+    stats->messages_footprint = READ_ONCE(queuep->messages_footprint);
+    stats->high_water_footprint = READ_ONCE(queuep->high_water_footprint);
+    if(queuep->dead_letters != NULL) {
+
+        stats->dead_letters_count = READ_ONCE(queuep->dead_letters->messages_count);
+    }
+}
+
+/* Prints the stats as "name value" lines into a sysfs buffer */
+static ssize_t print_stats(struct message_queue_stats* stats, char* buf) {
+
+    ssize_t length = 0;
+    length += sysfs_emit_at(buf, length, "messages_enqueued %llu\n", stats->messages_enqueued);
+    length += sysfs_emit_at(buf, length, "bytes_enqueued %llu\n", stats->bytes_enqueued);
+    length += sysfs_emit_at(buf, length, "messages_dequeued %llu\n", stats->messages_dequeued);
+    length += sysfs_emit_at(buf, length, "bytes_dequeued %llu\n", stats->bytes_dequeued);
+    length += sysfs_emit_at(buf, length, "log_reads %llu\n", stats->log_reads);
+    length += sysfs_emit_at(buf, length, "messages_evicted %llu\n", stats->messages_evicted);
+    length += sysfs_emit_at(buf, length, "rejected_eagain %llu\n", stats->rejected_eagain);
+    length += sysfs_emit_at(buf, length, "rejected_einval %llu\n", stats->rejected_einval);
+    length += sysfs_emit_at(buf, length, "rejected_efault %llu\n", stats->rejected_efault);
+    length += sysfs_emit_at(buf, length, "allocation_failures %llu\n", stats->allocation_failures);
+    length += sysfs_emit_at(buf, length, "blocked_reads %llu\n", stats->blocked_reads);
+    length += sysfs_emit_at(buf, length, "blocked_writes %llu\n", stats->blocked_writes);
+    length += sysfs_emit_at(buf, length, "messages_count %llu\n", stats->messages_count);
+    length += sysfs_emit_at(buf, length, "messages_size %llu\n", stats->messages_size);
+    length += sysfs_emit_at(buf, length, "high_water_count %llu\n", stats->high_water_count);
+    length += sysfs_emit_at(buf, length, "high_water_size %llu\n", stats->high_water_size);
+    length += sysfs_emit_at(buf, length, "messages_footprint %llu\n", stats->messages_footprint);
+    length += sysfs_emit_at(buf, length, "high_water_footprint %llu\n", stats->high_water_footprint);
+    length += sysfs_emit_at(buf, length, "throttled_writes %llu\n", stats->throttled_writes);
+    length += sysfs_emit_at(buf, length, "messages_overrun %llu\n", stats->messages_overrun);
+    length += sysfs_emit_at(buf, length, "messages_expired %llu\n", stats->messages_expired);
+    length += sysfs_emit_at(buf, length, "messages_delayed %llu\n", stats->messages_delayed);
+    length += sysfs_emit_at(buf, length, "messages_acked %llu\n", stats->messages_acked);
+    length += sysfs_emit_at(buf, length, "messages_redelivered %llu\n", stats->messages_redelivered);
+    length += sysfs_emit_at(buf, length, "messages_dead_lettered %llu\n", stats->messages_dead_lettered);
+    length += sysfs_emit_at(buf, length, "dead_letters_dropped %llu\n", stats->dead_letters_dropped);
+    length += sysfs_emit_at(buf, length, "dead_letters_count %llu\n", stats->dead_letters_count);
+    length += sysfs_emit_at(buf, length, "transactions_committed %llu\n", stats->transactions_committed);
+    length += sysfs_emit_at(buf, length, "transactions_aborted %llu\n", stats->transactions_aborted);
+    length += sysfs_emit_at(buf, length, "calls_sent %llu\n", stats->calls_sent);
+    length += sysfs_emit_at(buf, length, "replies_sent %llu\n", stats->replies_sent);
+    length += sysfs_emit_at(buf, length, "replies_refused %llu\n", stats->replies_refused);
+    length += sysfs_emit_at(buf, length, "rendezvous_handoffs %llu\n", stats->rendezvous_handoffs);
+    return length;
+}
+
+/* Counts the time elapsed since start in the histogram of the current CPU */
+static inline void record_latency(struct latency_histogram __percpu* histogram, ktime_t start) {
+
+    s64 nanoseconds = ktime_to_ns(ktime_sub(ktime_get(), start));
+    unsigned int bucket = 0;
+    if(nanoseconds > 1) {
+
+        bucket = min_t(unsigned int, ilog2(nanoseconds), LATENCY_BUCKETS - 1);
+    }
+    this_cpu_inc(histogram->buckets[bucket]);
+}
+
+/* Returns the id of the cgroup v2 the current task belongs to, or 0 without cgroups */
+static inline unsigned long long current_cgroup_id(void) {
+
+#ifdef CONFIG_CGROUPS
+    rcu_read_lock();
+    unsigned long long id = cgroup_id(task_dfl_cgroup(current));
+    rcu_read_unlock();
+    return id;
+#else
+    return 0;
+#endif
+}
+
+/* Called by lock_queue once it holds the lock, only while lock statistics are enabled */
+static inline void record_lock_acquired(int site, s64 wait_ns) {
+
+    this_cpu_inc(lock_stats.sites[site].acquisitions);
+    if(wait_ns != 0) {
+
+        this_cpu_inc(lock_stats.sites[site].contentions);
+        this_cpu_add(lock_stats.sites[site].wait_ns, wait_ns);
+    }
+}
+
+/* Called by unlock_queue after releasing a lock that lock_queue timed */
+static inline void record_lock_held(int site, s64 hold_ns) {
+
+    this_cpu_add(lock_stats.sites[site].hold_ns, hold_ns);
+}
+
+/*
+ * Returns the upper bound in nanoseconds of the bucket holding the given
+ * fraction (in thousandths) of all the counted latencies.
+ */
+static unsigned long long latency_percentile(unsigned long* buckets, unsigned long total, unsigned int permille) {
+
+    /* Rank of the wanted latency, rounded up so p999 of 10 samples is the largest */
+    unsigned long long rank = ((unsigned long long) total * permille + 999) / 1000;
+    unsigned long long seen = 0;
+    unsigned int bucket;
+    for(bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+
+        seen += buckets[bucket];
+        if(seen >= rank) {
+
+            break;
+        }
+    }
+    if(bucket >= LATENCY_BUCKETS - 1) {
+
+        return ULLONG_MAX;
+    }
+    return (2ULL << bucket) - 1;
+}
+
+/* Sums the per-CPU histogram given as the debugfs file data and prints it */
+static int latency_histogram_show(struct seq_file* m, void* v) {
+
+    struct latency_histogram __percpu* histogram = m->private;
+    unsigned long buckets[LATENCY_BUCKETS] = { 0 };
+    unsigned long total = 0;
+    unsigned int bucket;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+
+        for(bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+
+            buckets[bucket] += per_cpu_ptr(histogram, cpu)->buckets[bucket];
+        }
+    }
+    for(bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+
+        total += buckets[bucket];
+    }
+
+    seq_printf(m, "count %lu\n", total);
+    if(total != 0) {
+
+        seq_printf(m, "p50_ns %llu\n", latency_percentile(buckets, total, 500));
+        seq_printf(m, "p99_ns %llu\n", latency_percentile(buckets, total, 990));
+        seq_printf(m, "p999_ns %llu\n", latency_percentile(buckets, total, 999));
+    }
+
+    /* Only the buckets that were hit, as "from_ns to_ns count" */
+    for(bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+
+        if(buckets[bucket] != 0) {
+
+            seq_printf(m, "%llu %llu %lu\n", bucket == 0 ? 0ULL : 1ULL << bucket, (2ULL << bucket) - 1, buckets[bucket]);
+        }
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(latency_histogram);
+
+/* Sums the lock statistics of every CPU and prints one line per site */
+static int lock_stats_show(struct seq_file* m, void* v) {
+
+    seq_printf(m, "enabled %d\n", static_key_enabled(&lock_stats_key) ? 1 : 0);
+    seq_printf(m, "%-18s %14s %14s %14s %14s %12s %12s\n", "site", "acquisitions", "contentions",
+               "wait_ns", "hold_ns", "avg_wait_ns", "avg_hold_ns");
+
+    int site;
+    for(site = 0; site < LOCK_SITES; site++) {
+
+        struct lock_site_stats total = { 0 };
+        int cpu;
+        for_each_possible_cpu(cpu) {
+
+            struct lock_site_stats* stats = &per_cpu_ptr(&lock_stats, cpu)->sites[site];
+            total.acquisitions += stats->acquisitions;
+            total.contentions += stats->contentions;
+            total.wait_ns += stats->wait_ns;
+            total.hold_ns += stats->hold_ns;
+        }
+
+        unsigned long long acquisitions = total.acquisitions > 0 ? total.acquisitions : 1;
+        seq_printf(m, "%-18s %14llu %14llu %14llu %14llu %12llu %12llu\n", lock_site_names[site],
+                   total.acquisitions, total.contentions, total.wait_ns, total.hold_ns,
+                   div64_u64(total.wait_ns, acquisitions), div64_u64(total.hold_ns, acquisitions));
+    }
+    return 0;
+}
+
+static int lock_stats_open(struct inode* inodep, struct file* filep) {
+
+    return single_open(filep, lock_stats_show, NULL);
+}
+
+/*
+ * Writing 1 clears the lock statistics and starts recording, 0 stops.
+ * While stopped lock_queue and unlock_queue skip the recording entirely.
+ */
+static ssize_t lock_stats_write(struct file* filep, const char* buffer, size_t length, loff_t* offset) {
+
+    bool enable;
+    int error = kstrtobool_from_user(buffer, length, &enable);
+    if(error != 0) {
+
+        return error;
+    }
+
+    mutex_lock(&lock_stats_switch);
+    if(enable && !static_key_enabled(&lock_stats_key)) {
+
+        int cpu;
+        for_each_possible_cpu(cpu) {
+
+            memset(per_cpu_ptr(&lock_stats, cpu), 0, sizeof(struct lock_stats));
+        }
+        static_branch_enable(&lock_stats_key);
+    } else if(!enable) {
+
+        static_branch_disable(&lock_stats_key);
+    }
+    mutex_unlock(&lock_stats_switch);
+    return length;
+}
+
+static const struct file_operations lock_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = lock_stats_open,
+	.read = seq_read,
+	.write = lock_stats_write,
+	.llseek = seq_lseek,
+	.release = single_release
+};
+
+/*
+ * Prints what every cgroup keeps in the queue given as the debugfs file data,
+ * as "cgroup_id messages footprint" lines. The id is the inode number of the
+ * cgroup directory, so `stat -c %i /sys/fs/cgroup/<path>` finds it.
+ */
+static int cgroup_usage_show(struct seq_file* m, void* v) {
+
+    struct message_queue* queuep = m->private;
+    lock_queue(queuep, LOCK_SITE_DEBUGFS);
+    struct message_cgroup_usage* usage;
+    for(usage = queuep->cgroup_usage; usage != NULL; usage = usage->next) {
+
+        seq_printf(m, "%llu %lu %lu\n", usage->cgroup_id, usage->messages_count, usage->messages_footprint);
+    }
+    unlock_queue(queuep);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(cgroup_usage);
+
+#endif
@@ -0,0 +1,129 @@
+/**
+ * @file charDeviceDriverTrace.h
+ * @author Alexandru Blinda
+ * @date 6 November 2017
+ * @version 0.1
+ * @brief Header file that declares the tracepoints of the device drivers.
+ * They replace the printk calls on the read and write paths; while a
+ * tracepoint is disabled it costs a single patched-out branch.
+ * Enable them with 'echo 1 > /sys/kernel/tracing/events/opsysmem/enable'.
+ * Part of exercise 3 for Operating Systems Module (creating a character device
+ * driver).
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM opsysmem
+
+#if !defined(CHARDEVICEDRIVERTRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define CHARDEVICEDRIVERTRACE_H
+
+#include <linux/tracepoint.h>
+
+/* A message entered or left the queue; count and size describe the queue afterwards */
+DECLARE_EVENT_CLASS(opsysmem_message,
+
+    TP_PROTO(unsigned long message_size, unsigned long long sequence, unsigned int priority,
+             unsigned long messages_count, unsigned long messages_size),
+
+    TP_ARGS(message_size, sequence, priority, messages_count, messages_size),
+
+    TP_STRUCT__entry(
+        __field(unsigned long, message_size)
+        __field(unsigned long long, sequence)
+        __field(unsigned int, priority)
+        __field(unsigned long, messages_count)
+        __field(unsigned long, messages_size)
+    ),
+
+    TP_fast_assign(
+        __entry->message_size = message_size;
+        __entry->sequence = sequence;
+        __entry->priority = priority;
+        __entry->messages_count = messages_count;
+        __entry->messages_size = messages_size;
+    ),
+
+    TP_printk("size=%lu seq=%llu prio=%u count=%lu queued=%lu",
+              __entry->message_size, __entry->sequence, __entry->priority,
+              __entry->messages_count, __entry->messages_size)
+);
+
+DEFINE_EVENT(opsysmem_message, opsysmem_enqueue,
+    TP_PROTO(unsigned long message_size, unsigned long long sequence, unsigned int priority,
+             unsigned long messages_count, unsigned long messages_size),
+    TP_ARGS(message_size, sequence, priority, messages_count, messages_size)
+);
+
+DEFINE_EVENT(opsysmem_message, opsysmem_dequeue,
+    TP_PROTO(unsigned long message_size, unsigned long long sequence, unsigned int priority,
+             unsigned long messages_count, unsigned long messages_size),
+    TP_ARGS(message_size, sequence, priority, messages_count, messages_size)
+);
+
+/* A log mode reader copied a message without removing it */
+DEFINE_EVENT(opsysmem_message, opsysmem_log_read,
+    TP_PROTO(unsigned long message_size, unsigned long long sequence, unsigned int priority,
+             unsigned long messages_count, unsigned long messages_size),
+    TP_ARGS(message_size, sequence, priority, messages_count, messages_size)
+);
+
+/* A read or write failed with the given error */
+TRACE_EVENT(opsysmem_reject,
+
+    TP_PROTO(int is_write, size_t length, int error),
+
+    TP_ARGS(is_write, length, error),
+
+    TP_STRUCT__entry(
+        __field(int, is_write)
+        __field(size_t, length)
+        __field(int, error)
+    ),
+
+    TP_fast_assign(
+        __entry->is_write = is_write;
+        __entry->length = length;
+        __entry->error = error;
+    ),
+
+    TP_printk("%s length=%zu error=%d", __entry->is_write ? "write" : "read",
+              __entry->length, __entry->error)
+);
+
+/* A reader or writer of the blocking driver goes to sleep or is woken up */
+DECLARE_EVENT_CLASS(opsysmem_wait,
+
+    TP_PROTO(int is_write, size_t length),
+
+    TP_ARGS(is_write, length),
+
+    TP_STRUCT__entry(
+        __field(int, is_write)
+        __field(size_t, length)
+    ),
+
+    TP_fast_assign(
+        __entry->is_write = is_write;
+        __entry->length = length;
+    ),
+
+    TP_printk("%s length=%zu", __entry->is_write ? "write" : "read", __entry->length)
+);
+
+DEFINE_EVENT(opsysmem_wait, opsysmem_block,
+    TP_PROTO(int is_write, size_t length),
+    TP_ARGS(is_write, length)
+);
+
+DEFINE_EVENT(opsysmem_wait, opsysmem_wakeup,
+    TP_PROTO(int is_write, size_t length),
+    TP_ARGS(is_write, length)
+);
+
+#endif
+
+/* This part must be outside the header guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE charDeviceDriverTrace
+#include <trace/define_trace.h>
@@ -0,0 +1,2615 @@
+/**
+ * @file messageQueue.c
+ * @author Alexandru Blinda
+ * @date 6 November 2017
+ * @version 0.1
+ * @brief C file that defines the message queue used by both drivers.
+ * It only relies on the kernel functions the drivers already include, so
+ * bench/queueShim.h can provide them and build the same file in user space.
+ * The drivers include this file, so the functions stay static to each module.
+ * Part of exercise 3 for Operating Systems Module (creating a character device
+ * driver).
+ */
+#include "messageQueue.h"
+
+/* Helpers only used in this file */
+static char* message_chunk(struct message_queue_data*, unsigned long, unsigned long*);
+static void free_node_list(struct message_queue*, struct message_queue_node*);
+static void free_node(struct message_queue_node*);
+static void bury_dropped_nodes(struct message_queue*, struct message_queue_node*);
+static int append_dead_letter(struct message_queue*, struct message_queue_node*);
+static int fits_under(unsigned long, unsigned long, unsigned long);
+static int fits_in_queue(struct message_queue*, unsigned long, unsigned long, struct message_producer*);
+static int exceeds_limits(struct message_queue*, unsigned long, struct message_producer*);
+static int charge_cgroup_usage(struct message_queue*, struct message_queue_node*, unsigned long long);
+static void uncharge_cgroup_usage(struct message_queue*, struct message_queue_node*);
+static void unaccount_node(struct message_queue*, struct message_queue_node*);
+static void init_producer(struct message_producer*);
+static void link_fair_node(struct message_queue*, struct message_queue_node*);
+static struct message_queue_node* unlink_fair_node(struct message_queue*);
+static void evict_oldest_messages(struct message_queue*);
+static void link_node(struct message_queue*, struct message_queue_node*);
+static struct message_queue_node* merge_delayed_heaps(struct message_queue_node*, struct message_queue_node*);
+static struct message_queue_node* merge_delayed_children(struct message_queue_node*);
+static void link_delayed_node(struct message_queue*, struct message_queue_node*);
+static struct message_queue_node* unlink_delayed_node(struct message_queue*);
+static struct message_queue_node* unlink_readable_node(struct message_queue*, struct message_queue_node**);
+static struct message_inflight** find_inflight(struct message_queue*, unsigned long long);
+static void link_inflight(struct message_queue*, struct message_inflight*);
+static void unlink_inflight(struct message_queue*, struct message_inflight*);
+static void requeue_node(struct message_queue*, struct message_queue_node*);
+static struct message_queue_node* unlink_next_node(struct message_queue*);
+static int is_node_expired(struct message_queue_node*, ktime_t);
+static void drop_expired_node(struct message_queue*, struct message_queue_node*, struct message_queue_node**);
+static unsigned int unlink_expired_nodes(struct message_queue*, ktime_t, unsigned int, struct message_queue_node**);
+static struct message_queue_node* walk_list_head(struct message_queue*, struct message_queue_walk*);
+static int walk_next_list(struct message_queue*, struct message_queue_walk*);
+static struct message_queue_node* walk_first_node(struct message_queue*, struct message_queue_walk*);
+static struct message_queue_node* walk_to(struct message_queue_walk*, struct message_queue_node*);
+static void link_priority_node(struct message_queue*, struct message_queue_node*);
+static struct message_queue_node* unlink_priority_node(struct message_queue*);
+static unsigned int node_list(struct message_queue*, struct message_queue_node*);
+static struct message_queue_node* unlink_list_head(struct message_queue*, unsigned int);
+static struct message_queue_node* unlink_oldest_typed_node(struct message_queue*);
+static struct message_queue_node* unlink_typed_node(struct message_queue*, unsigned int, int);
+static struct message_queue_data* finish_dequeue(struct message_queue*, struct message_queue_node*, struct message_queue_node*, unsigned int*);
+static void splice_staged_list(struct message_queue*, struct message_priority_list*, unsigned long long);
+static void release_reservation(struct message_queue*, struct message_transaction*);
+static struct message_call** find_call(struct message_queue*, unsigned int);
+static void deliver_call(struct message_call**, int, struct message_queue_data*);
+static void fail_call(struct message_queue*, unsigned int);
+
+QUEUE_API struct message_queue* initialise_queue(void) {
+
+    struct message_queue* queuep = (struct message_queue*) kmalloc(sizeof(struct message_queue), GFP_KERNEL);
+
+    if(queuep != NULL) {
+
+        mutex_init(&queuep->lock);
+        queuep->lock_contentions = queuep->lock_wait_ns = 0;
+        queuep->lock_acquired = 0;
+        queuep->lock_site = LOCK_SITE_RELEASE;
+        queuep->head = queuep->rear = NULL;
+        queuep->max_messages_size = DEFAULT_MAX_MESSAGES_SIZE;
+        queuep->max_messages_count = 0;
+        queuep->messages_size = 0;
+        queuep->messages_footprint = 0;
+        queuep->messages_count = 0;
+        queuep->high_water_count = queuep->high_water_size = queuep->high_water_footprint = 0;
+        queuep->next_sequence = 0;
+        queuep->mode = QUEUE_MODE_FIFO;
+
+        int priority;
+        for(priority = 0; priority < MESSAGE_PRIORITY_LEVELS; priority++) {
+
+            queuep->priority_lists[priority].head = queuep->priority_lists[priority].rear = NULL;
+        }
+        queuep->priority_bitmap = 0;
+        queuep->cgroup_usage = NULL;
+        queuep->spare_usage = NULL;
+        init_producer(&queuep->default_producer);
+        queuep->active_head = queuep->active_rear = NULL;
+        queuep->expiring_count = 0;
+        queuep->delayed_root = NULL;
+        queuep->delayed_count = queuep->delayed_footprint = 0;
+        queuep->next_due = 0;
+        memset(queuep->inflight_table, 0, sizeof(queuep->inflight_table));
+        queuep->inflight_head = queuep->inflight_rear = NULL;
+        queuep->inflight_count = queuep->inflight_footprint = 0;
+        queuep->next_receipt = 0;
+        queuep->visibility_timeout_ms = DEFAULT_VISIBILITY_TIMEOUT_MS;
+        queuep->next_timeout = 0;
+        queuep->requeue_generation = 0;
+        queuep->max_deliveries = 0;
+        queuep->dead_letters = NULL;
+        queuep->holds_dead_letters = 0;
+        queuep->transactions_count = 0;
+        queuep->reserved_count = queuep->reserved_footprint = 0;
+        queuep->offers_head = queuep->offers_rear = NULL;
+        memset(queuep->call_table, 0, sizeof(queuep->call_table));
+        queuep->next_correlation_id = 0;
+        queuep->replies_footprint = 0;
+    }
+    return queuep;
+}
+
+/* Sets up a producer without messages */
+static void init_producer(struct message_producer* producer) {
+
+    producer->head = producer->rear = NULL;
+    producer->next_active = NULL;
+    producer->messages_count = 0;
+    producer->messages_footprint = 0;
+    producer->quota = 0;
+    producer->deficit = 0;
+    producer->open = 1;
+}
+
+/* Creates the producer of a newly opened file */
+QUEUE_API struct message_producer* open_producer(struct message_queue* queuep) {
+
+    struct message_producer* producer = (struct message_producer*) kmalloc(sizeof(struct message_producer), GFP_KERNEL);
+    if(producer != NULL) {
+
+        init_producer(producer);
+    }
+    return producer;
+}
+
+/*
+ * Lets go of the producer of a closed file. Its messages stay in the queue
+ * and the producer is freed together with the last of them.
+ */
+QUEUE_API void close_producer(struct message_queue* queuep, struct message_producer* producer) {
+
+    lock_queue(queuep, LOCK_SITE_RELEASE);
+    producer->open = 0;
+    if(producer->messages_count == 0) {
+
+        kfree(producer);
+    }
+    unlock_queue(queuep);
+}
+
+QUEUE_API void release_queue(struct message_queue* queuep) {
+
+    /* If the pointer is null, we cannot release anything */
+    if(queuep == NULL) {
+
+        return;
+    }
+
+    /* Lock because we are going to access the queue and modify it */
+    lock_queue(queuep, LOCK_SITE_RELEASE);
+    /* Free the main list, every priority list and every producer list; the usages and producers go with them */
+    free_node_list(queuep, queuep->head);
+    int priority;
+    for(priority = 0; priority < MESSAGE_PRIORITY_LEVELS; priority++) {
+
+        free_node_list(queuep, queuep->priority_lists[priority].head);
+    }
+    while(queuep->active_head != NULL) {
+
+        struct message_producer* producer = queuep->active_head;
+        struct message_queue_node* tmp_node = producer->head;
+        queuep->active_head = producer->next_active;
+        producer->head = producer->rear = NULL;
+        free_node_list(queuep, tmp_node);
+    }
+    /* Children of a freed delayed node go in front of its siblings */
+    while(queuep->delayed_root != NULL) {
+
+        struct message_queue_node* tmp_node = queuep->delayed_root;
+        queuep->delayed_root = tmp_node->delayed_sibling;
+        if(tmp_node->delayed_child != NULL) {
+
+            struct message_queue_node* last_child = tmp_node->delayed_child;
+            while(last_child->delayed_sibling != NULL) {
+
+                last_child = last_child->delayed_sibling;
+            }
+            last_child->delayed_sibling = queuep->delayed_root;
+            queuep->delayed_root = tmp_node->delayed_child;
+        }
+        unaccount_node(queuep, tmp_node);
+        free_node(tmp_node);
+    }
+    while(queuep->inflight_head != NULL) {
+
+        struct message_inflight* inflight = queuep->inflight_head;
+        queuep->inflight_head = inflight->next;
+        unaccount_node(queuep, inflight->node);
+        free_node(inflight->node);
+        kfree(inflight);
+    }
+    kfree(queuep->spare_usage);
+    unlock_queue(queuep);
+    mutex_destroy(&queuep->lock);
+    kfree(queuep);
+}
+
+/* Goes through all the nodes starting from the given one and frees them 1 by 1 */
+static void free_node_list(struct message_queue* queuep, struct message_queue_node* tmp_node) {
+
+    struct message_queue_node* iterator_node = tmp_node;
+    while(iterator_node != NULL) {
+
+        iterator_node = iterator_node->next;
+        unaccount_node(queuep, tmp_node);
+        free_node(tmp_node);
+        tmp_node = iterator_node;
+    }
+}
+
+/*
+ * Frees nodes dropped unread from the queue and its totals, linked through
+ * next. Their nodes move to the dead letter queue instead if the queue has
+ * one; a message that does not fit there is lost. Must be called without
+ * queuep->lock held, as it takes the lock of the dead letter queue.
+ */
+static void bury_dropped_nodes(struct message_queue* queuep, struct message_queue_node* tmp_node) {
+
+    while(tmp_node != NULL) {
+
+        struct message_queue_node* next_node = tmp_node->next;
+        if(queuep->dead_letters != NULL) {
+
+            if(append_dead_letter(queuep->dead_letters, tmp_node) == SUCCESS) {
+
+                this_cpu_inc(queue_counters.messages_dead_lettered);
+                tmp_node = next_node;
+                continue;
+            }
+            this_cpu_inc(queue_counters.dead_letters_dropped);
+        }
+        free_node(tmp_node);
+        tmp_node = next_node;
+    }
+}
+
+/*
+ * Links a node dropped from another queue, and already taken out of its
+ * totals, at the end of the dead letter queue. Unlike enqueue it is not a
+ * new message: the enqueue counters and trace events, which counted it
+ * once already, are left alone, and so is the cgroup of current, often a
+ * worker reaping the other queue. The message is charged to no cgroup
+ * and belongs to the default producer. The dead letter queue is only ever
+ * in FIFO mode. Returns SUCCESS, or -EAGAIN if it does not fit, in which
+ * case the caller still owns the node.
+ */
+static int append_dead_letter(struct message_queue* dead_letters, struct message_queue_node* tmp_node) {
+
+    struct message_producer* producer = &dead_letters->default_producer;
+    lock_queue(dead_letters, LOCK_SITE_ENQUEUE);
+    if(exceeds_limits(dead_letters, tmp_node->data->footprint, producer)
+            || fits_in_queue(dead_letters, 1, tmp_node->data->footprint, producer) == 0) {
+
+        unlock_queue(dead_letters);
+        return -EAGAIN;
+    }
+
+    tmp_node->correlation_id = 0; /* Its call was failed as it was dropped */
+    tmp_node->expire_time = 0;
+    tmp_node->usage = NULL;
+    tmp_node->producer = producer;
+    dead_letters->messages_size += tmp_node->data->message_size;
+    dead_letters->messages_footprint += tmp_node->data->footprint;
+    dead_letters->messages_count++;
+    producer->messages_count++;
+    producer->messages_footprint += tmp_node->data->footprint;
+
+    tmp_node->next = NULL;
+    tmp_node->sequence = dead_letters->next_sequence++;
+    if(dead_letters->rear == NULL) {
+
+        dead_letters->head = dead_letters->rear = tmp_node;
+    } else {
+
+        dead_letters->rear->next = tmp_node;
+        dead_letters->rear = tmp_node;
+    }
+    unlock_queue(dead_letters);
+    return SUCCESS;
+}
+
+/* Frees a node together with its data and message */
+static void free_node(struct message_queue_node* tmp_node) {
+
+    if(tmp_node->data != NULL) {
+
+        free_message_data(tmp_node->data);
+    }
+    kfree(tmp_node);
+}
+
+/*
+ * Returns the memory a message of the given size takes once enqueued: the
+ * slab objects of its node, its data and its payload as the allocator rounds
+ * them up, or the whole pages of a big message. A queue of tiny messages is
+ * mostly this overhead, so it is what max_messages_size limits.
+ */
+QUEUE_API unsigned long message_footprint(unsigned long message_size) {
+
+    unsigned long footprint = kmalloc_size_roundup(sizeof(struct message_queue_node))
+                              + kmalloc_size_roundup(sizeof(struct message_queue_data));
+    if(message_size <= PAGE_SIZE) {
+
+        return footprint + kmalloc_size_roundup(message_size);
+    }
+
+    unsigned long page_count = DIV_ROUND_UP(message_size, PAGE_SIZE);
+    return footprint + kmalloc_size_roundup(page_count * sizeof(struct page*)) + page_count * PAGE_SIZE;
+}
+
+/*
+ * Allocates the storage for a message of the given size.
+ * Messages up to a page are kept in one kmalloc buffer; bigger ones are kept
+ * in separate pages so they never need a high-order allocation.
+ * Everything is charged to the memory cgroup of the writer, so its limits
+ * also limit what it can keep in the queue.
+ */
+QUEUE_API struct message_queue_data* alloc_message_data(unsigned long message_size) {
+
+    struct message_queue_data* tmp_data = (struct message_queue_data*) kmalloc(sizeof(struct message_queue_data), GFP_KERNEL_ACCOUNT);
+    if(tmp_data == NULL) {
+
+        return NULL;
+    }
+    tmp_data->message = NULL;
+    tmp_data->message_size = message_size;
+    tmp_data->footprint = message_footprint(message_size);
+    refcount_set(&tmp_data->users, 1);
+
+    if(message_size <= PAGE_SIZE) {
+
+        tmp_data->message = (char*) kmalloc(message_size * sizeof(char), GFP_KERNEL_ACCOUNT);
+        if(tmp_data->message == NULL) {
+
+            kfree(tmp_data);
+            return NULL;
+        }
+        return tmp_data;
+    }
+
+    unsigned long page_count = DIV_ROUND_UP(message_size, PAGE_SIZE);
+    tmp_data->pages = (struct page**) kcalloc(page_count, sizeof(struct page*), GFP_KERNEL_ACCOUNT);
+    if(tmp_data->pages == NULL) {
+
+        kfree(tmp_data);
+        return NULL;
+    }
+
+    unsigned long i;
+    for(i = 0; i < page_count; i++) {
+
+        tmp_data->pages[i] = alloc_page(GFP_KERNEL_ACCOUNT);
+        if(tmp_data->pages[i] == NULL) {
+
+            free_message_data(tmp_data);
+            return NULL;
+        }
+    }
+    return tmp_data;
+}
+
+/* Drops a reference to a message; the last one frees it and its storage, whichever form it has */
+QUEUE_API void free_message_data(struct message_queue_data* tmp_data) {
+
+    if(!refcount_dec_and_test(&tmp_data->users)) {
+
+        return;
+    }
+    if(tmp_data->message_size > PAGE_SIZE && tmp_data->pages != NULL) {
+
+        unsigned long page_count = DIV_ROUND_UP(tmp_data->message_size, PAGE_SIZE);
+        unsigned long i;
+        for(i = 0; i < page_count; i++) {
+
+            if(tmp_data->pages[i] != NULL) {
+
+                __free_page(tmp_data->pages[i]);
+            }
+        }
+        kfree(tmp_data->pages);
+    }
+    if(tmp_data->message_size <= PAGE_SIZE && tmp_data->message != NULL) {
+
+        kfree(tmp_data->message);
+    }
+    kfree(tmp_data);
+}
+
+/*
+ * Returns the stored bytes starting at offset and sets chunk_length to the
+ * number of bytes that are contiguous from there.
+ */
+static char* message_chunk(struct message_queue_data* data, unsigned long offset, unsigned long* chunk_length) {
+
+    if(data->message_size <= PAGE_SIZE) {
+
+        *chunk_length = data->message_size - offset;
+        return data->message + offset;
+    }
+
+    unsigned long page_offset = offset % PAGE_SIZE;
+    *chunk_length = PAGE_SIZE - page_offset;
+    return (char*) page_address(data->pages[offset / PAGE_SIZE]) + page_offset;
+}
+
+/*
+ * Takes the queue lock for the given LOCK_SITE_*. Only when somebody else
+ * holds it the wait is timed, so an uncontended lock costs no more than before.
+ * While lock statistics are enabled the site, its wait and the time it holds
+ * the lock are recorded as well.
+ */
+QUEUE_API void lock_queue(struct message_queue* queuep, int site) {
+
+    s64 wait_ns = 0;
+    if(!mutex_trylock(&queuep->lock)) {
+
+        ktime_t start = ktime_get();
+        mutex_lock(&queuep->lock);
+        wait_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+        queuep->lock_contentions++;
+        queuep->lock_wait_ns += wait_ns;
+    }
+
+    if(static_branch_unlikely(&lock_stats_key)) {
+
+        record_lock_acquired(site, wait_ns);
+        queuep->lock_site = site;
+        queuep->lock_acquired = ktime_get();
+    }
+}
+
+QUEUE_API void unlock_queue(struct message_queue* queuep) {
+
+    /* Cleared every time, so a lock taken before statistics were enabled is never timed */
+    ktime_t acquired = queuep->lock_acquired;
+    int site = queuep->lock_site;
+    queuep->lock_acquired = 0;
+    mutex_unlock(&queuep->lock);
+
+    if(static_branch_unlikely(&lock_stats_key) && acquired != 0) {
+
+        record_lock_held(site, ktime_to_ns(ktime_sub(ktime_get(), acquired)));
+    }
+}
+
+/*
+ * Links an allocated message at the end of the queue, which then owns it.
+ * Returns -EAGAIN if the message does not fit now, -EMSGSIZE if it never
+ * will, or -ENOMEM. The space is
+ * checked under the same lock that links the message, so concurrent writers
+ * cannot all pass is_space_in_queue and then overfill the queue together.
+ * A message with a ttl_ms other than 0 is never dequeued after that many
+ * milliseconds; reap_expired_messages frees it. A message with a not_before
+ * time still to come takes its room now but is only readable once
+ * promote_delayed_messages links it after that time. The correlation_id of
+ * a call is handed to its reader by dequeue_call. The type, below
+ * MESSAGE_TYPES, is what dequeue_type selects on in typed mode.
+ */
+QUEUE_API int enqueue(struct message_queue* queuep, struct message_queue_data* data, unsigned int priority, unsigned int type, unsigned long ttl_ms, ktime_t not_before, unsigned int correlation_id, struct message_producer* producer) {
+
+    /* Nothing happens */
+    if(queuep == NULL) {
+
+        return -EINVAL;
+    }
+    if(producer == NULL) {
+
+        producer = &queuep->default_producer;
+    }
+
+    /* Allocate memory for a node */
+    struct message_queue_node* tmp_node = (struct message_queue_node*) kmalloc(sizeof(struct message_queue_node), GFP_KERNEL_ACCOUNT);
+
+    /* If allocation failed, return -ENOMEM */
+    if(tmp_node == NULL) {
+
+        return -ENOMEM;
+    }
+
+    tmp_node->next = NULL;
+    tmp_node->data = data;
+    tmp_node->priority = priority;
+    tmp_node->type = type;
+    tmp_node->deliveries = 0;
+    tmp_node->correlation_id = correlation_id;
+    tmp_node->producer = producer;
+    unsigned long long cgroup_id = current_cgroup_id();
+
+    lock_queue(queuep, LOCK_SITE_ENQUEUE);
+    if(exceeds_limits(queuep, data->footprint, producer)) {
+
+        unlock_queue(queuep);
+        kfree(tmp_node);
+        return -EMSGSIZE;
+    }
+    if(fits_in_queue(queuep, 1, data->footprint, producer) == 0) {
+
+        unlock_queue(queuep);
+        kfree(tmp_node);
+        return -EAGAIN;
+    }
+    if(charge_cgroup_usage(queuep, tmp_node, cgroup_id) != SUCCESS) {
+
+        unlock_queue(queuep);
+        kfree(tmp_node);
+        return -ENOMEM;
+    }
+    tmp_node->enqueue_time = ktime_get();
+    int delayed = not_before != 0 && ktime_before(tmp_node->enqueue_time, not_before);
+    if(delayed) {
+
+        tmp_node->enqueue_time = not_before;
+    }
+    /* The time to live starts once the message can be read */
+    tmp_node->expire_time = 0;
+    if(ttl_ms != 0) {
+
+        tmp_node->expire_time = ktime_add_ms(tmp_node->enqueue_time, ttl_ms);
+        queuep->expiring_count++;
+    }
+
+    queuep->messages_size = queuep->messages_size + tmp_node->data->message_size;
+    queuep->messages_footprint = queuep->messages_footprint + tmp_node->data->footprint;
+    queuep->messages_count++;
+    producer->messages_count++;
+    producer->messages_footprint += tmp_node->data->footprint;
+    if(queuep->messages_count > queuep->high_water_count) {
+
+        queuep->high_water_count = queuep->messages_count;
+    }
+    if(queuep->messages_size > queuep->high_water_size) {
+
+        queuep->high_water_size = queuep->messages_size;
+    }
+    if(queuep->messages_footprint > queuep->high_water_footprint) {
+
+        queuep->high_water_footprint = queuep->messages_footprint;
+    }
+    this_cpu_inc(queue_counters.messages_enqueued);
+    this_cpu_add(queue_counters.bytes_enqueued, tmp_node->data->message_size);
+
+    if(delayed) {
+
+        link_delayed_node(queuep, tmp_node);
+        this_cpu_inc(queue_counters.messages_delayed);
+    } else {
+
+        link_node(queuep, tmp_node);
+    }
+    unlock_queue(queuep);
+    return SUCCESS;
+}
+
+/*
+ * Makes an accounted message readable: gives it the next sequence and links
+ * it into the list of the current mode. In log and ring mode the oldest
+ * messages make room for it. Must be called with queuep->lock held.
+ */
+static void link_node(struct message_queue* queuep, struct message_queue_node* tmp_node) {
+
+    tmp_node->next = NULL;
+    tmp_node->sequence = queuep->next_sequence++;
+    if(queuep->mode == QUEUE_MODE_PRIORITY || queuep->mode == QUEUE_MODE_TYPED) {
+
+        link_priority_node(queuep, tmp_node);
+    } else if(queuep->mode == QUEUE_MODE_FAIR) {
+
+        link_fair_node(queuep, tmp_node);
+    } else if(queuep->rear == NULL) { /* It means this is our first element to be added */
+
+        queuep->head = queuep->rear = tmp_node;
+    } else { /* It is not our first element */
+
+        queuep->rear->next = tmp_node;
+        queuep->rear = queuep->rear->next;
+    }
+    trace_opsysmem_enqueue(tmp_node->data->message_size, tmp_node->sequence, tmp_node->priority,
+                           queuep->messages_count, queuep->messages_size);
+
+    if(queuep->mode == QUEUE_MODE_LOG || queuep->mode == QUEUE_MODE_RING) {
+
+        evict_oldest_messages(queuep);
+    }
+}
+
+/*
+ * Delayed messages wait in a pairing heap ordered by when they are due.
+ * It reuses the next and sequence fields of the nodes, which only matter
+ * once a message is readable, so delaying costs no memory. Adding is O(1)
+ * and taking the first due is O(log n) amortised.
+ */
+
+/* Merges two heaps and returns the root of the result. Must be called with queuep->lock held. */
+static struct message_queue_node* merge_delayed_heaps(struct message_queue_node* first, struct message_queue_node* second) {
+
+    if(first == NULL) {
+
+        return second;
+    }
+    if(second == NULL) {
+
+        return first;
+    }
+    if(ktime_before(second->enqueue_time, first->enqueue_time)) {
+
+        struct message_queue_node* tmp_node = first;
+        first = second;
+        second = tmp_node;
+    }
+    second->delayed_sibling = first->delayed_child;
+    first->delayed_child = second;
+    return first;
+}
+
+/*
+ * Merges the children of a removed root into one heap: pairs from the left
+ * first, then the pairs from the right. Must be called with queuep->lock held.
+ */
+static struct message_queue_node* merge_delayed_children(struct message_queue_node* child) {
+
+    struct message_queue_node* pairs = NULL;
+    while(child != NULL) {
+
+        struct message_queue_node* first = child;
+        struct message_queue_node* second = first->delayed_sibling;
+        child = second != NULL ? second->delayed_sibling : NULL;
+        first->delayed_sibling = NULL;
+        if(second != NULL) {
+
+            second->delayed_sibling = NULL;
+        }
+
+        struct message_queue_node* pair = merge_delayed_heaps(first, second);
+        pair->delayed_sibling = pairs;
+        pairs = pair;
+    }
+
+    struct message_queue_node* root = NULL;
+    while(pairs != NULL) {
+
+        struct message_queue_node* pair = pairs;
+        pairs = pair->delayed_sibling;
+        pair->delayed_sibling = NULL;
+        root = merge_delayed_heaps(root, pair);
+    }
+    return root;
+}
+
+/* Adds an accounted message to the delayed ones. Must be called with queuep->lock held. */
+static void link_delayed_node(struct message_queue* queuep, struct message_queue_node* tmp_node) {
+
+    tmp_node->delayed_child = tmp_node->delayed_sibling = NULL;
+    queuep->delayed_root = merge_delayed_heaps(queuep->delayed_root, tmp_node);
+    queuep->delayed_count++;
+    queuep->delayed_footprint += tmp_node->data->footprint;
+    queuep->next_due = queuep->delayed_root->enqueue_time;
+}
+
+/* Removes the delayed message due first, or returns NULL. Must be called with queuep->lock held. */
+static struct message_queue_node* unlink_delayed_node(struct message_queue* queuep) {
+
+    struct message_queue_node* tmp_node = queuep->delayed_root;
+    if(tmp_node == NULL) {
+
+        return NULL;
+    }
+
+    queuep->delayed_root = merge_delayed_children(tmp_node->delayed_child);
+    queuep->delayed_count--;
+    queuep->delayed_footprint -= tmp_node->data->footprint;
+    queuep->next_due = queuep->delayed_root != NULL ? queuep->delayed_root->enqueue_time : 0;
+    tmp_node->next = NULL;
+    return tmp_node;
+}
+
+/*
+ * Links the delayed messages that are due into the queue, DELAY_BATCH per
+ * hold of the lock, dropping the ones whose time to live is already over.
+ * Returns how many became readable; next_due tells when to call it again.
+ */
+QUEUE_API unsigned long promote_delayed_messages(struct message_queue* queuep) {
+
+    unsigned long promoted = 0;
+    unsigned int batch;
+
+    if(queuep == NULL) {
+
+        return 0;
+    }
+
+    do {
+
+        struct message_queue_node* expired = NULL;
+        lock_queue(queuep, LOCK_SITE_PROMOTE);
+        ktime_t now = ktime_get();
+        for(batch = 0; batch < DELAY_BATCH && queuep->delayed_root != NULL
+                && !ktime_before(now, queuep->delayed_root->enqueue_time); batch++) {
+
+            struct message_queue_node* tmp_node = unlink_delayed_node(queuep);
+            if(is_node_expired(tmp_node, now)) {
+
+                drop_expired_node(queuep, tmp_node, &expired);
+                continue;
+            }
+            link_node(queuep, tmp_node);
+            promoted++;
+        }
+        unlock_queue(queuep);
+
+        bury_dropped_nodes(queuep, expired);
+    } while(batch == DELAY_BATCH);
+
+    return promoted;
+}
+
+/*
+ * Frees messages from the head until the queue fits in its max_messages_size
+ * and max_messages_count. The newest message is always kept. Must be called
+ * with queuep->lock held.
+ */
+static void evict_oldest_messages(struct message_queue* queuep) {
+
+    while((queuep->messages_footprint + queuep->replies_footprint > queuep->max_messages_size
+            || (queuep->max_messages_count != 0 && queuep->messages_count > queuep->max_messages_count))
+            && queuep->head != queuep->rear) {
+
+        struct message_queue_node* tmp_node = queuep->head;
+        queuep->head = queuep->head->next;
+        unaccount_node(queuep, tmp_node);
+        if(queuep->mode == QUEUE_MODE_RING) {
+
+            this_cpu_inc(queue_counters.messages_overrun);
+        } else {
+
+            this_cpu_inc(queue_counters.messages_evicted);
+        }
+
+        free_node(tmp_node);
+    }
+}
+
+/*
+ * Removes a message leaving the queue from the totals of the queue, its
+ * cgroup and its producer. A closed producer goes with its last message, and
+ * the call of a call message, unless dequeue_call took it, as nobody can
+ * reply any more. Must be called with queuep->lock held.
+ */
+static void unaccount_node(struct message_queue* queuep, struct message_queue_node* tmp_node) {
+
+    if(tmp_node->correlation_id != 0) {
+
+        fail_call(queuep, tmp_node->correlation_id);
+    }
+
+    queuep->messages_size = queuep->messages_size - tmp_node->data->message_size;
+    queuep->messages_footprint = queuep->messages_footprint - tmp_node->data->footprint;
+    queuep->messages_count--;
+    if(tmp_node->expire_time != 0) {
+
+        queuep->expiring_count--;
+    }
+    uncharge_cgroup_usage(queuep, tmp_node);
+
+    struct message_producer* producer = tmp_node->producer;
+    producer->messages_count--;
+    producer->messages_footprint -= tmp_node->data->footprint;
+    tmp_node->producer = NULL;
+    if(producer->messages_count == 0 && producer->open == 0) {
+
+        kfree(producer);
+    }
+}
+
+/*
+ * Adds a message to the usage of the given cgroup, creating the usage if it
+ * is the first message of the cgroup. Must be called with queuep->lock held.
+ */
+static int charge_cgroup_usage(struct message_queue* queuep, struct message_queue_node* tmp_node, unsigned long long cgroup_id) {
+
+    struct message_cgroup_usage* usage = queuep->cgroup_usage;
+    while(usage != NULL && usage->cgroup_id != cgroup_id) {
+
+        usage = usage->next;
+    }
+
+    if(usage == NULL) {
+
+        usage = queuep->spare_usage;
+        queuep->spare_usage = NULL;
+        if(usage == NULL) {
+
+            usage = (struct message_cgroup_usage*) kmalloc(sizeof(struct message_cgroup_usage), GFP_KERNEL_ACCOUNT);
+        }
+        if(usage == NULL) {
+
+            return -ENOMEM;
+        }
+        usage->cgroup_id = cgroup_id;
+        usage->messages_count = 0;
+        usage->messages_footprint = 0;
+        usage->next = queuep->cgroup_usage;
+        queuep->cgroup_usage = usage;
+    }
+
+    usage->messages_count++;
+    usage->messages_footprint += tmp_node->data->footprint;
+    tmp_node->usage = usage;
+    return SUCCESS;
+}
+
+/*
+ * Removes a message leaving the queue from the usage of its cgroup and frees
+ * the usage with the last message. Must be called with queuep->lock held.
+ */
+static void uncharge_cgroup_usage(struct message_queue* queuep, struct message_queue_node* tmp_node) {
+
+    struct message_cgroup_usage* usage = tmp_node->usage;
+    /* Dead letters are charged to no cgroup */
+    if(usage == NULL) {
+
+        return;
+    }
+    usage->messages_count--;
+    usage->messages_footprint -= tmp_node->data->footprint;
+    tmp_node->usage = NULL;
+    if(usage->messages_count != 0) {
+
+        return;
+    }
+
+    struct message_cgroup_usage** link = &queuep->cgroup_usage;
+    while(*link != usage) {
+
+        link = &(*link)->next;
+    }
+    *link = usage->next;
+    if(queuep->spare_usage == NULL) {
+
+        queuep->spare_usage = usage;
+    } else {
+
+        kfree(usage);
+    }
+}
+
+/* Returns which of priority_lists a node goes in: the one of its type in typed mode, otherwise of its priority */
+static unsigned int node_list(struct message_queue* queuep, struct message_queue_node* tmp_node) {
+
+    return queuep->mode == QUEUE_MODE_TYPED ? tmp_node->type : tmp_node->priority;
+}
+
+/*
+ * Appends a node to its list of priority_lists and marks the list as used.
+ * Must be called with queuep->lock held.
+ */
+static void link_priority_node(struct message_queue* queuep, struct message_queue_node* tmp_node) {
+
+    unsigned int list = node_list(queuep, tmp_node);
+    struct message_priority_list* listp = &queuep->priority_lists[list];
+    if(listp->rear == NULL) {
+
+        listp->head = listp->rear = tmp_node;
+    } else {
+
+        listp->rear->next = tmp_node;
+        listp->rear = tmp_node;
+    }
+    __set_bit(list, &queuep->priority_bitmap);
+}
+
+/* Removes the oldest node of a used list of priority_lists. Must be called with queuep->lock held. */
+static struct message_queue_node* unlink_list_head(struct message_queue* queuep, unsigned int list) {
+
+    struct message_priority_list* listp = &queuep->priority_lists[list];
+    struct message_queue_node* tmp_node = listp->head;
+
+    listp->head = tmp_node->next;
+    if(listp->head == NULL) {
+
+        listp->rear = NULL;
+        __clear_bit(list, &queuep->priority_bitmap);
+    }
+    tmp_node->next = NULL;
+    return tmp_node;
+}
+
+/*
+ * Removes the oldest node of the highest used priority, or returns NULL.
+ * The bitmap gives the highest priority in O(1) whatever the number of levels.
+ * Must be called with queuep->lock held.
+ */
+static struct message_queue_node* unlink_priority_node(struct message_queue* queuep) {
+
+    if(queuep->priority_bitmap == 0) {
+
+        return NULL;
+    }
+    return unlink_list_head(queuep, __fls(queuep->priority_bitmap));
+}
+
+/*
+ * Removes the oldest node of any type, or returns NULL. Sequences grow along
+ * every list, so it is the head with the lowest sequence; only the used
+ * types are looked at. Must be called with queuep->lock held.
+ */
+static struct message_queue_node* unlink_oldest_typed_node(struct message_queue* queuep) {
+
+    if(queuep->priority_bitmap == 0) {
+
+        return NULL;
+    }
+
+    unsigned long bitmap = queuep->priority_bitmap;
+    unsigned int oldest = __ffs(bitmap);
+    __clear_bit(oldest, &bitmap);
+    while(bitmap != 0) {
+
+        unsigned int type = __ffs(bitmap);
+        __clear_bit(type, &bitmap);
+        if(queuep->priority_lists[type].head->sequence < queuep->priority_lists[oldest].head->sequence) {
+
+            oldest = type;
+        }
+    }
+    return unlink_list_head(queuep, oldest);
+}
+
+/*
+ * Removes the oldest node of the given type, or with lowest set of the
+ * lowest used type up to it, or returns NULL. Each type has its own list,
+ * so either is O(1) however many messages of other types wait before it.
+ * Must be called with queuep->lock held.
+ */
+static struct message_queue_node* unlink_typed_node(struct message_queue* queuep, unsigned int type, int lowest) {
+
+    unsigned long bitmap = queuep->priority_bitmap & (lowest ? (2UL << type) - 1 : 1UL << type);
+    if(bitmap == 0) {
+
+        return NULL;
+    }
+    return unlink_list_head(queuep, __ffs(bitmap));
+}
+
+/*
+ * Appends a node to the list of its producer. A producer getting its first
+ * message joins the end of the round with no credit.
+ * Must be called with queuep->lock held.
+ */
+static void link_fair_node(struct message_queue* queuep, struct message_queue_node* tmp_node) {
+
+    struct message_producer* producer = tmp_node->producer;
+    if(producer->rear != NULL) {
+
+        producer->rear->next = tmp_node;
+        producer->rear = tmp_node;
+        return;
+    }
+
+    producer->head = producer->rear = tmp_node;
+    producer->deficit = 0;
+    producer->next_active = NULL;
+    if(queuep->active_rear == NULL) {
+
+        queuep->active_head = queuep->active_rear = producer;
+    } else {
+
+        queuep->active_rear->next_active = producer;
+        queuep->active_rear = producer;
+    }
+}
+
+/*
+ * Removes the next node in deficit round robin order, or returns NULL.
+ * The producer at the head of the round keeps being read while its credit
+ * covers the footprint of its oldest message. Otherwise it gets another
+ * FAIR_QUANTUM and goes to the end of the round. Costs are footprints, so
+ * empty messages are not free. Must be called with queuep->lock held.
+ */
+static struct message_queue_node* unlink_fair_node(struct message_queue* queuep) {
+
+    while(queuep->active_head != NULL) {
+
+        struct message_producer* producer = queuep->active_head;
+        struct message_queue_node* tmp_node = producer->head;
+        if(tmp_node->data->footprint <= producer->deficit) {
+
+            producer->deficit -= tmp_node->data->footprint;
+            producer->head = tmp_node->next;
+            tmp_node->next = NULL;
+            if(producer->head == NULL) {
+
+                /* Out of the round; unused credit is not kept */
+                producer->rear = NULL;
+                producer->deficit = 0;
+                queuep->active_head = producer->next_active;
+                if(queuep->active_head == NULL) {
+
+                    queuep->active_rear = NULL;
+                }
+                producer->next_active = NULL;
+            }
+            return tmp_node;
+        }
+
+        producer->deficit += FAIR_QUANTUM;
+        if(producer->next_active != NULL) {
+
+            queuep->active_head = producer->next_active;
+            producer->next_active = NULL;
+            queuep->active_rear->next_active = producer;
+            queuep->active_rear = producer;
+        }
+    }
+    return NULL;
+}
+
+/* Removes the next node readers should get in the current mode, or returns NULL */
+static struct message_queue_node* unlink_next_node(struct message_queue* queuep) {
+
+    if(queuep->mode == QUEUE_MODE_PRIORITY) {
+
+        return unlink_priority_node(queuep);
+    }
+    if(queuep->mode == QUEUE_MODE_FAIR) {
+
+        return unlink_fair_node(queuep);
+    }
+    if(queuep->mode == QUEUE_MODE_TYPED) {
+
+        return unlink_oldest_typed_node(queuep);
+    }
+
+    /* If there is no message in the queue, we cannot dequeue */
+    if(queuep->head == NULL) {
+
+        return NULL;
+    }
+
+    /* If we are in the case of one element in the queue, just move the rear to NULL */
+    if(queuep->head == queuep->rear) {
+
+        queuep->rear = queuep->rear->next;
+    }
+    /* If there is message in the queue, fetch it */
+    struct message_queue_node* tmp_node = queuep->head;
+    /* Move the head to the next element */
+    queuep->head = queuep->head->next;
+    tmp_node->next = NULL;
+    return tmp_node;
+}
+
+/*
+ * Removes the next message readers should get, or returns NULL. Expired
+ * messages met on the way are dropped onto the given list instead, to be
+ * freed once the lock is released. Must be called with queuep->lock held.
+ */
+static struct message_queue_node* unlink_readable_node(struct message_queue* queuep, struct message_queue_node** expired) {
+
+    /* Reading the clock is only worth it while some message can expire */
+    ktime_t now = queuep->expiring_count != 0 ? ktime_get() : 0;
+    struct message_queue_node* tmp_node;
+    while((tmp_node = unlink_next_node(queuep)) != NULL && is_node_expired(tmp_node, now)) {
+
+        drop_expired_node(queuep, tmp_node, expired);
+    }
+    return tmp_node;
+}
+
+/* Returns the next message and removes it from the queue, or NULL */
+QUEUE_API struct message_queue_data* dequeue(struct message_queue* queuep) {
+
+    /* Cannot dequeue an empty queue */
+    if(queuep == NULL) {
+
+        return NULL;
+    }
+
+    lock_queue(queuep, LOCK_SITE_DEQUEUE);
+
+    struct message_queue_node* expired = NULL;
+    struct message_queue_node* tmp_node = unlink_readable_node(queuep, &expired);
+    return finish_dequeue(queuep, tmp_node, expired, NULL);
+}
+
+/*
+ * Like dequeue, also storing the correlation ID of the message, or 0, in
+ * correlation_id. Returns NULL in log and rendezvous mode: every log reader
+ * reads each message, so a call would be answered by all of them, and there
+ * is no queue to take one from in rendezvous mode. The mode is checked under
+ * the same lock, so a switch cannot slip in before the message is taken.
+ */
+QUEUE_API struct message_queue_data* dequeue_call(struct message_queue* queuep, unsigned int* correlation_id) {
+
+    if(queuep == NULL) {
+
+        return NULL;
+    }
+
+    lock_queue(queuep, LOCK_SITE_DEQUEUE);
+    if(queuep->mode == QUEUE_MODE_LOG || queuep->mode == QUEUE_MODE_RENDEZVOUS) {
+
+        unlock_queue(queuep);
+        return NULL;
+    }
+
+    struct message_queue_node* expired = NULL;
+    struct message_queue_node* tmp_node = unlink_readable_node(queuep, &expired);
+    return finish_dequeue(queuep, tmp_node, expired, correlation_id);
+}
+
+/*
+ * Like dequeue for a queue in typed mode, taking the oldest message of the
+ * given type, or with lowest set the oldest of the lowest type up to it.
+ * The type of the message is stored in read_type. Returns NULL if there is
+ * no such message or the queue is in another mode.
+ */
+QUEUE_API struct message_queue_data* dequeue_type(struct message_queue* queuep, unsigned int type, int lowest, unsigned int* read_type) {
+
+    if(queuep == NULL || type >= MESSAGE_TYPES) {
+
+        return NULL;
+    }
+
+    lock_queue(queuep, LOCK_SITE_DEQUEUE);
+
+    struct message_queue_node* expired = NULL;
+    struct message_queue_node* tmp_node = NULL;
+    if(queuep->mode == QUEUE_MODE_TYPED) {
+
+        ktime_t now = queuep->expiring_count != 0 ? ktime_get() : 0;
+        while((tmp_node = unlink_typed_node(queuep, type, lowest)) != NULL && is_node_expired(tmp_node, now)) {
+
+            drop_expired_node(queuep, tmp_node, &expired);
+        }
+    }
+    if(tmp_node != NULL) {
+
+        *read_type = tmp_node->type;
+    }
+    return finish_dequeue(queuep, tmp_node, expired, NULL);
+}
+
+/*
+ * Takes the data of a node unlinked by a dequeue out of the queue and frees
+ * the node, or returns NULL if there was none. Releases queuep->lock, which
+ * must be held, and then the expired nodes met on the way.
+ */
+static struct message_queue_data* finish_dequeue(struct message_queue* queuep, struct message_queue_node* tmp_node, struct message_queue_node* expired, unsigned int* correlation_id) {
+
+    if(tmp_node == NULL) {
+
+        unlock_queue(queuep);
+        bury_dropped_nodes(queuep, expired);
+        return NULL;
+    }
+    /* Its reader can reply to it, so the call must not be failed as the message leaves */
+    if(correlation_id != NULL) {
+
+        *correlation_id = tmp_node->correlation_id;
+        tmp_node->correlation_id = 0;
+    }
+    unaccount_node(queuep, tmp_node);
+    /* A dead letter left the traffic counted here when it was dropped */
+    if(queuep->holds_dead_letters == 0) {
+
+        trace_opsysmem_dequeue(tmp_node->data->message_size, tmp_node->sequence, tmp_node->priority,
+                               queuep->messages_count, queuep->messages_size);
+        record_latency(&residency_histogram, tmp_node->enqueue_time);
+        this_cpu_inc(queue_counters.messages_dequeued);
+        this_cpu_add(queue_counters.bytes_dequeued, tmp_node->data->message_size);
+    }
+
+    unlock_queue(queuep);
+    bury_dropped_nodes(queuep, expired);
+
+    struct message_queue_data* tmp_data = tmp_node->data;
+    /* Free the fetched node */
+    kfree(tmp_node);
+    return tmp_data;
+}
+
+/* Returns 1 if the time to live of the node is over at now */
+static int is_node_expired(struct message_queue_node* tmp_node, ktime_t now) {
+
+    return tmp_node->expire_time != 0 && !ktime_before(now, tmp_node->expire_time);
+}
+
+/*
+ * Takes an expired node already unlinked from its list out of the totals and
+ * puts it on the given list, for bury_dropped_nodes once the lock is released.
+ * Must be called with queuep->lock held.
+ */
+static void drop_expired_node(struct message_queue* queuep, struct message_queue_node* tmp_node, struct message_queue_node** expired) {
+
+    unaccount_node(queuep, tmp_node);
+    this_cpu_inc(queue_counters.messages_expired);
+    tmp_node->next = *expired;
+    *expired = tmp_node;
+}
+
+/*
+ * Unlinks up to budget expired nodes from the heads of the lists and puts
+ * them on the given list. Only heads are looked at: messages leave a list
+ * from its head alone, which log readers and walks rely on. A message behind
+ * one that lives longer is dropped once it gets to the head, or by dequeue.
+ * Returns how many nodes were unlinked. Must be called with queuep->lock held.
+ */
+static unsigned int unlink_expired_nodes(struct message_queue* queuep, ktime_t now, unsigned int budget, struct message_queue_node** expired) {
+
+    unsigned int unlinked = 0;
+    struct message_queue_node* tmp_node;
+
+    while(unlinked < budget && queuep->head != NULL && is_node_expired(queuep->head, now)) {
+
+        tmp_node = queuep->head;
+        queuep->head = tmp_node->next;
+        if(queuep->head == NULL) {
+
+            queuep->rear = NULL;
+        }
+        drop_expired_node(queuep, tmp_node, expired);
+        unlinked++;
+    }
+
+    unsigned long bitmap = queuep->priority_bitmap;
+    while(unlinked < budget && bitmap != 0) {
+
+        unsigned int priority = __fls(bitmap);
+        struct message_priority_list* listp = &queuep->priority_lists[priority];
+        __clear_bit(priority, &bitmap);
+        while(unlinked < budget && listp->head != NULL && is_node_expired(listp->head, now)) {
+
+            tmp_node = listp->head;
+            listp->head = tmp_node->next;
+            if(listp->head == NULL) {
+
+                listp->rear = NULL;
+                __clear_bit(priority, &queuep->priority_bitmap);
+            }
+            drop_expired_node(queuep, tmp_node, expired);
+            unlinked++;
+        }
+    }
+
+    /* A producer left without messages also leaves the round, as in unlink_fair_node */
+    struct message_producer* previous = NULL;
+    struct message_producer* producer = queuep->active_head;
+    while(unlinked < budget && producer != NULL) {
+
+        struct message_producer* next_producer = producer->next_active;
+        struct message_queue_node* dropped = NULL;
+        while(unlinked < budget && producer->head != NULL && is_node_expired(producer->head, now)) {
+
+            tmp_node = producer->head;
+            producer->head = tmp_node->next;
+            tmp_node->next = dropped;
+            dropped = tmp_node;
+            unlinked++;
+        }
+
+        if(producer->head == NULL) {
+
+            producer->rear = NULL;
+            producer->deficit = 0;
+            producer->next_active = NULL;
+            if(previous == NULL) {
+
+                queuep->active_head = next_producer;
+            } else {
+
+                previous->next_active = next_producer;
+            }
+            if(queuep->active_rear == producer) {
+
+                queuep->active_rear = previous;
+            }
+        } else {
+
+            previous = producer;
+        }
+
+        /* Only now, since the last message of a closed producer frees it */
+        while(dropped != NULL) {
+
+            tmp_node = dropped;
+            dropped = dropped->next;
+            drop_expired_node(queuep, tmp_node, expired);
+        }
+        producer = next_producer;
+    }
+    return unlinked;
+}
+
+/*
+ * Frees the messages whose time to live is over, EXPIRY_BATCH per hold of
+ * the lock so readers and writers are not kept waiting behind a large reap.
+ * Returns how many were freed.
+ */
+QUEUE_API unsigned long reap_expired_messages(struct message_queue* queuep) {
+
+    unsigned long reaped = 0;
+    unsigned int unlinked;
+
+    if(queuep == NULL) {
+
+        return 0;
+    }
+
+    do {
+
+        struct message_queue_node* expired = NULL;
+        lock_queue(queuep, LOCK_SITE_REAP);
+        unlinked = 0;
+        if(queuep->expiring_count != 0) {
+
+            unlinked = unlink_expired_nodes(queuep, ktime_get(), EXPIRY_BATCH, &expired);
+        }
+        unlock_queue(queuep);
+
+        bury_dropped_nodes(queuep, expired);
+        reaped += unlinked;
+    } while(unlinked == EXPIRY_BATCH);
+
+    return reaped;
+}
+
+QUEUE_API int is_queue_empty(struct message_queue* queuep) {
+
+    if(queuep == NULL) {
+
+        return -1;
+    }
+
+    lock_queue(queuep, LOCK_SITE_IS_EMPTY);
+
+    /* Empty messages are messages too, so count them rather than their bytes; delayed and received ones cannot be read */
+    if(queuep->messages_count == queuep->delayed_count + queuep->inflight_count) {
+
+        unlock_queue(queuep);
+        return 1;
+    }
+
+    unlock_queue(queuep);
+    return 0;
+}
+
+/* Returns 1 if dequeue_type with the same arguments may find a message, as a hint like is_queue_empty */
+QUEUE_API int is_type_available(struct message_queue* queuep, unsigned int type, int lowest) {
+
+    if(queuep == NULL || type >= MESSAGE_TYPES) {
+
+        return 0;
+    }
+
+    lock_queue(queuep, LOCK_SITE_IS_EMPTY);
+    int available = queuep->mode == QUEUE_MODE_TYPED
+                    && (queuep->priority_bitmap & (lowest ? (2UL << type) - 1 : 1UL << type)) != 0;
+    unlock_queue(queuep);
+    return available;
+}
+
+/*
+ * Returns 1 if a message of the length fits now, 0 if not yet, or -EMSGSIZE
+ * if it never will. Only a hint once the lock is dropped; enqueue checks again.
+ */
+QUEUE_API int is_space_in_queue(struct message_queue* queuep, unsigned long length, struct message_producer* producer) {
+
+    if(queuep == NULL) {
+
+        return -1;
+    }
+    if(producer == NULL) {
+
+        producer = &queuep->default_producer;
+    }
+
+    unsigned long footprint = message_footprint(length);
+    lock_queue(queuep, LOCK_SITE_IS_SPACE);
+    int fits = exceeds_limits(queuep, footprint, producer) ? -EMSGSIZE : fits_in_queue(queuep, 1, footprint, producer);
+    unlock_queue(queuep);
+    return fits;
+}
+
+/*
+ * Sets the limit on the memory the messages take. It cannot go below what they
+ * take now, so that writers never wait on room nothing can make. Returns
+ * SUCCESS, or -EINVAL if it would.
+ */
+QUEUE_API int resize_queue(struct message_queue* queuep, unsigned long max_messages_size) {
+
+    int error = -EINVAL;
+    lock_queue(queuep, LOCK_SITE_IOCTL);
+    if(max_messages_size > queuep->messages_footprint) {
+
+        queuep->max_messages_size = max_messages_size;
+        error = SUCCESS;
+    }
+    unlock_queue(queuep);
+    return error;
+}
+
+/* Sets the optional limit on the number of messages, 0 for none, the same way as resize_queue */
+QUEUE_API int set_max_messages_count(struct message_queue* queuep, unsigned long max_messages_count) {
+
+    int error = -EINVAL;
+    lock_queue(queuep, LOCK_SITE_IOCTL);
+    if(max_messages_count == 0 || max_messages_count >= queuep->messages_count) {
+
+        queuep->max_messages_count = max_messages_count;
+        error = SUCCESS;
+    }
+    unlock_queue(queuep);
+    return error;
+}
+
+/*
+ * Returns 1 if amount more fits under the limit once used is taken, 0
+ * otherwise. amount comes from the user, so it is never added to used: the
+ * sum could wrap around and pass. used can be over the limit after the limit
+ * was lowered, which is checked first so the subtraction cannot wrap either.
+ */
+static int fits_under(unsigned long used, unsigned long amount, unsigned long limit) {
+
+    return used <= limit && amount <= limit - used;
+}
+
+/*
+ * Returns 1 if count messages with the given footprint can be enqueued now
+ * by the producer, 0 otherwise. Room reserved by open transactions is taken.
+ * The totals added here only count what was let in already, so they cannot
+ * wrap; begin_transaction keeps the reserved ones within the limits.
+ * Must be called with queuep->lock held.
+ */
+static int fits_in_queue(struct message_queue* queuep, unsigned long count, unsigned long footprint, struct message_producer* producer) {
+
+    /* The log and the ring evict old messages instead, so only the message and those that cannot be evicted, delayed or in flight, have to fit */
+    if(queuep->mode == QUEUE_MODE_LOG || queuep->mode == QUEUE_MODE_RING) {
+
+        return fits_under(queuep->delayed_footprint + queuep->inflight_footprint + queuep->reserved_footprint + queuep->replies_footprint,
+                          footprint, queuep->max_messages_size);
+    }
+
+    if(queuep->max_messages_count != 0
+            && fits_under(queuep->messages_count + queuep->reserved_count, count, queuep->max_messages_count) == 0) {
+
+        return 0;
+    }
+    /* One producer cannot take the whole queue from the others */
+    if(producer->quota != 0 && fits_under(producer->messages_footprint, footprint, producer->quota) == 0) {
+
+        return 0;
+    }
+    return fits_under(queuep->messages_footprint + queuep->reserved_footprint + queuep->replies_footprint, footprint, queuep->max_messages_size);
+}
+
+/*
+ * Returns 1 if a message with the given footprint is bigger than the queue or
+ * than the quota of the producer, so that no read could ever make room for
+ * it, 0 otherwise. Must be called with queuep->lock held.
+ */
+static int exceeds_limits(struct message_queue* queuep, unsigned long footprint, struct message_producer* producer) {
+
+    if(footprint > queuep->max_messages_size) {
+
+        return 1;
+    }
+    /* The log and the ring do not apply quotas */
+    return queuep->mode != QUEUE_MODE_LOG && queuep->mode != QUEUE_MODE_RING
+           && producer->quota != 0 && footprint > producer->quota;
+}
+
+/*
+ * At least once delivery. receive_message hands a message out without
+ * freeing it: it waits in the in-flight table until ack_message frees it, or
+ * until its visibility timeout is over and requeue_timed_out_messages puts it
+ * back where it was, in front of every message written after it.
+ * Receipts are consecutive, so the low bits spread them evenly over the
+ * buckets of the table and a lookup looks at one or two records.
+ */
+
+/* Returns the link pointing at the record of the receipt, or at NULL. Must be called with queuep->lock held. */
+static struct message_inflight** find_inflight(struct message_queue* queuep, unsigned long long receipt) {
+
+    struct message_inflight** link = &queuep->inflight_table[receipt & (INFLIGHT_BUCKETS - 1)];
+    while(*link != NULL && (*link)->receipt != receipt) {
+
+        link = &(*link)->hash_next;
+    }
+    return link;
+}
+
+/*
+ * Adds a record to the in-flight table and to the deadline list. Records
+ * usually come in deadline order, so looking from the rear is O(1) unless
+ * the visibility timeout was shortened. Must be called with queuep->lock held.
+ */
+static void link_inflight(struct message_queue* queuep, struct message_inflight* inflight) {
+
+    struct message_inflight** bucket = &queuep->inflight_table[inflight->receipt & (INFLIGHT_BUCKETS - 1)];
+    inflight->hash_next = *bucket;
+    *bucket = inflight;
+
+    struct message_inflight* previous = queuep->inflight_rear;
+    while(previous != NULL && ktime_before(inflight->deadline, previous->deadline)) {
+
+        previous = previous->previous;
+    }
+    inflight->previous = previous;
+    inflight->next = previous != NULL ? previous->next : queuep->inflight_head;
+    if(inflight->next != NULL) {
+
+        inflight->next->previous = inflight;
+    } else {
+
+        queuep->inflight_rear = inflight;
+    }
+    if(previous != NULL) {
+
+        previous->next = inflight;
+    } else {
+
+        queuep->inflight_head = inflight;
+    }
+
+    queuep->inflight_count++;
+    queuep->inflight_footprint += inflight->node->data->footprint;
+    queuep->next_timeout = queuep->inflight_head->deadline;
+}
+
+/* Removes a record from the in-flight table and the deadline list. Must be called with queuep->lock held. */
+static void unlink_inflight(struct message_queue* queuep, struct message_inflight* inflight) {
+
+    *find_inflight(queuep, inflight->receipt) = inflight->hash_next;
+    if(inflight->previous != NULL) {
+
+        inflight->previous->next = inflight->next;
+    } else {
+
+        queuep->inflight_head = inflight->next;
+    }
+    if(inflight->next != NULL) {
+
+        inflight->next->previous = inflight->previous;
+    } else {
+
+        queuep->inflight_rear = inflight->previous;
+    }
+    inflight->hash_next = inflight->previous = inflight->next = NULL;
+
+    queuep->inflight_count--;
+    queuep->inflight_footprint -= inflight->node->data->footprint;
+    queuep->next_timeout = queuep->inflight_head != NULL ? queuep->inflight_head->deadline : 0;
+}
+
+/*
+ * Puts a message that was read back into the list of the current mode, in
+ * sequence order so sequences still grow along the list. It is usually the
+ * new head. Must be called with queuep->lock held.
+ */
+static void requeue_node(struct message_queue* queuep, struct message_queue_node* tmp_node) {
+
+    struct message_queue_node** link = &queuep->head;
+    struct message_queue_node** rear = &queuep->rear;
+
+    if(queuep->mode == QUEUE_MODE_PRIORITY || queuep->mode == QUEUE_MODE_TYPED) {
+
+        unsigned int list = node_list(queuep, tmp_node);
+        struct message_priority_list* listp = &queuep->priority_lists[list];
+        link = &listp->head;
+        rear = &listp->rear;
+        __set_bit(list, &queuep->priority_bitmap);
+    } else if(queuep->mode == QUEUE_MODE_FAIR) {
+
+        struct message_producer* producer = tmp_node->producer;
+        if(producer->head == NULL) {
+
+            link_fair_node(queuep, tmp_node);
+            return;
+        }
+        link = &producer->head;
+        rear = &producer->rear;
+    }
+
+    while(*link != NULL && (*link)->sequence < tmp_node->sequence) {
+
+        link = &(*link)->next;
+    }
+    tmp_node->next = *link;
+    *link = tmp_node;
+    if(tmp_node->next == NULL) {
+
+        *rear = tmp_node;
+    }
+}
+
+/*
+ * Copies the next message to the user and keeps it in flight under a new
+ * receipt, stored in receipt, for visibility_timeout_ms. The queue owns the
+ * given record on success and when the copy fails; otherwise the caller
+ * frees it. Returns the bytes copied, -EAGAIN if there is no message,
+ * -EFAULT if the copy failed, in which case the message goes back first,
+ * or -EINVAL in log mode, where reads do not consume, and in rendezvous
+ * mode, which has no queue.
+ */
+QUEUE_API ssize_t receive_message(struct message_queue* queuep, struct message_inflight* inflight, char* buffer, size_t length, unsigned long long* receipt) {
+
+    if(queuep == NULL) {
+
+        return -EINVAL;
+    }
+
+    lock_queue(queuep, LOCK_SITE_ACK);
+    if(queuep->mode == QUEUE_MODE_LOG || queuep->mode == QUEUE_MODE_RENDEZVOUS) {
+
+        unlock_queue(queuep);
+        return -EINVAL;
+    }
+
+    struct message_queue_node* expired = NULL;
+    struct message_queue_node* tmp_node = unlink_readable_node(queuep, &expired);
+    if(tmp_node == NULL) {
+
+        unlock_queue(queuep);
+        bury_dropped_nodes(queuep, expired);
+        return -EAGAIN;
+    }
+
+    /*
+     * The user buffer may fault, so the copy is done without the lock. The
+     * message is in flight meanwhile, which keeps log mode out, and the
+     * reference keeps it alive if its receipt is acknowledged or times out.
+     */
+    unsigned char deliveries = tmp_node->deliveries;
+    if(tmp_node->deliveries < U8_MAX) {
+
+        tmp_node->deliveries++;
+    }
+    unsigned long long new_receipt = ++queuep->next_receipt;
+    inflight->receipt = new_receipt;
+    inflight->deadline = ktime_add_ms(ktime_get(), queuep->visibility_timeout_ms);
+    inflight->node = tmp_node;
+    link_inflight(queuep, inflight);
+
+    struct message_queue_data* tmp_data = tmp_node->data;
+    refcount_inc(&tmp_data->users);
+    trace_opsysmem_dequeue(tmp_data->message_size, tmp_node->sequence, tmp_node->priority,
+                           queuep->messages_count, queuep->messages_size);
+    ktime_t enqueue_time = tmp_node->enqueue_time;
+    unlock_queue(queuep);
+    bury_dropped_nodes(queuep, expired);
+
+    ssize_t bytes_read = copy_message_to_user(tmp_data, buffer, length);
+    unsigned long message_size = tmp_data->message_size;
+    free_message_data(tmp_data);
+    if(bytes_read < 0) {
+
+        /* Goes back first unless its receipt was acknowledged or timed out meanwhile, which freed the record */
+        lock_queue(queuep, LOCK_SITE_ACK);
+        if(*find_inflight(queuep, new_receipt) == inflight) {
+
+            unlink_inflight(queuep, inflight);
+            tmp_node->deliveries = deliveries;
+            requeue_node(queuep, tmp_node);
+            queuep->requeue_generation++;
+            kfree(inflight);
+        }
+        unlock_queue(queuep);
+        return bytes_read;
+    }
+
+    record_latency(&residency_histogram, enqueue_time);
+    this_cpu_inc(queue_counters.messages_dequeued);
+    this_cpu_add(queue_counters.bytes_dequeued, message_size);
+    *receipt = new_receipt;
+    return bytes_read;
+}
+
+/* Frees a received message. Returns -EINVAL if the receipt is not in flight, e.g. because it timed out. */
+QUEUE_API int ack_message(struct message_queue* queuep, unsigned long long receipt) {
+
+    if(queuep == NULL) {
+
+        return -EINVAL;
+    }
+
+    lock_queue(queuep, LOCK_SITE_ACK);
+    struct message_inflight* inflight = *find_inflight(queuep, receipt);
+    if(inflight == NULL) {
+
+        unlock_queue(queuep);
+        return -EINVAL;
+    }
+    unlink_inflight(queuep, inflight);
+    unaccount_node(queuep, inflight->node);
+    this_cpu_inc(queue_counters.messages_acked);
+    unlock_queue(queuep);
+
+    free_node(inflight->node);
+    kfree(inflight);
+    return SUCCESS;
+}
+
+/*
+ * Puts the messages whose visibility timeout is over back into the queue,
+ * REDELIVERY_BATCH per hold of the lock. The ones whose time to live is over
+ * or that were received max_deliveries times are dropped instead. Returns
+ * how many can be read again; next_timeout tells when to call it again.
+ */
+QUEUE_API unsigned long requeue_timed_out_messages(struct message_queue* queuep) {
+
+    unsigned long requeued = 0;
+    unsigned int batch;
+
+    if(queuep == NULL) {
+
+        return 0;
+    }
+
+    do {
+
+        struct message_inflight* timed_out = NULL;
+        struct message_queue_node* dropped = NULL;
+        lock_queue(queuep, LOCK_SITE_ACK);
+        ktime_t now = ktime_get();
+        for(batch = 0; batch < REDELIVERY_BATCH && queuep->inflight_head != NULL
+                && !ktime_before(now, queuep->inflight_head->deadline); batch++) {
+
+            struct message_inflight* inflight = queuep->inflight_head;
+            struct message_queue_node* tmp_node = inflight->node;
+            unlink_inflight(queuep, inflight);
+            inflight->next = timed_out;
+            timed_out = inflight;
+
+            if(is_node_expired(tmp_node, now)) {
+
+                drop_expired_node(queuep, tmp_node, &dropped);
+                continue;
+            }
+            /* A message no reader gets through stops taking their time */
+            if(queuep->max_deliveries != 0 && tmp_node->deliveries >= queuep->max_deliveries) {
+
+                unaccount_node(queuep, tmp_node);
+                tmp_node->next = dropped;
+                dropped = tmp_node;
+                continue;
+            }
+            requeue_node(queuep, tmp_node);
+            this_cpu_inc(queue_counters.messages_redelivered);
+            requeued++;
+        }
+        if(batch != 0) {
+
+            queuep->requeue_generation++;
+        }
+        unlock_queue(queuep);
+
+        while(timed_out != NULL) {
+
+            struct message_inflight* inflight = timed_out;
+            timed_out = inflight->next;
+            kfree(inflight);
+        }
+        bury_dropped_nodes(queuep, dropped);
+    } while(batch == REDELIVERY_BATCH);
+
+    return requeued;
+}
+
+/*
+ * Transactions. Messages written in one wait on lists of the transaction,
+ * outside the queue, and are linked into it together when it commits, so
+ * readers see all of them or none. The room for them is reserved when it
+ * begins, so the commit cannot fail.
+ */
+
+/*
+ * Starts a transaction of up to max_messages messages taking max_footprint
+ * bytes, written by the given producer. Returns -EAGAIN if the queue does not
+ * have that room now, or -EINVAL if it could never have it.
+ */
+QUEUE_API int begin_transaction(struct message_queue* queuep, struct message_transaction* transaction, struct message_producer* producer, unsigned long max_messages, unsigned long max_footprint) {
+
+    if(queuep == NULL || max_messages == 0 || max_footprint == 0) {
+
+        return -EINVAL;
+    }
+    if(producer == NULL) {
+
+        producer = &queuep->default_producer;
+    }
+
+    unsigned int i;
+    for(i = 0; i < MESSAGE_PRIORITY_LEVELS; i++) {
+
+        transaction->lists[i].head = transaction->lists[i].rear = NULL;
+    }
+    /* Every message takes at least the footprint of an empty one, so more than this could never be staged */
+    if(max_messages > max_footprint / message_footprint(0)) {
+
+        max_messages = max_footprint / message_footprint(0);
+    }
+    transaction->list_bitmap = 0;
+    transaction->producer = producer;
+    transaction->max_messages = max_messages;
+    transaction->max_footprint = max_footprint;
+    transaction->messages_count = transaction->messages_size = transaction->messages_footprint = 0;
+    transaction->expiring_count = 0;
+
+    lock_queue(queuep, LOCK_SITE_ENQUEUE);
+    /* Bigger than the limits themselves, waiting would not help; this also keeps the reserved totals from wrapping */
+    if(exceeds_limits(queuep, max_footprint, producer)
+            || (queuep->max_messages_count != 0 && max_messages > queuep->max_messages_count)) {
+
+        unlock_queue(queuep);
+        return -EINVAL;
+    }
+    if(fits_in_queue(queuep, max_messages, max_footprint, producer) == 0) {
+
+        unlock_queue(queuep);
+        return -EAGAIN;
+    }
+    queuep->transactions_count++;
+    queuep->reserved_count += max_messages;
+    queuep->reserved_footprint += max_footprint;
+    unlock_queue(queuep);
+    return SUCCESS;
+}
+
+/*
+ * Adds an allocated message to an open transaction, which then owns it.
+ * Returns -ENOSPC if it does not fit in the room reserved, or -ENOMEM.
+ * The queue mode cannot change while the transaction is open, so the list
+ * the message goes to is still the right one when it commits.
+ */
+QUEUE_API int stage_message(struct message_queue* queuep, struct message_transaction* transaction, struct message_queue_data* data, unsigned int priority, unsigned int type, unsigned long ttl_ms, unsigned int correlation_id) {
+
+    if(transaction->messages_count == transaction->max_messages
+            || fits_under(transaction->messages_footprint, data->footprint, transaction->max_footprint) == 0) {
+
+        return -ENOSPC;
+    }
+
+    struct message_queue_node* tmp_node = (struct message_queue_node*) kmalloc(sizeof(struct message_queue_node), GFP_KERNEL_ACCOUNT);
+    if(tmp_node == NULL) {
+
+        return -ENOMEM;
+    }
+    tmp_node->next = NULL;
+    tmp_node->data = data;
+    tmp_node->priority = priority;
+    tmp_node->type = type;
+    tmp_node->deliveries = 0;
+    tmp_node->correlation_id = correlation_id;
+    tmp_node->producer = transaction->producer;
+    unsigned long long cgroup_id = current_cgroup_id();
+
+    /* The memory is taken now, so the cgroup pays for it now */
+    lock_queue(queuep, LOCK_SITE_ENQUEUE);
+    if(charge_cgroup_usage(queuep, tmp_node, cgroup_id) != SUCCESS) {
+
+        unlock_queue(queuep);
+        kfree(tmp_node);
+        return -ENOMEM;
+    }
+    unsigned int list = queuep->mode == QUEUE_MODE_PRIORITY || queuep->mode == QUEUE_MODE_TYPED ? node_list(queuep, tmp_node) : 0;
+    unlock_queue(queuep);
+
+    tmp_node->enqueue_time = ktime_get();
+    tmp_node->expire_time = 0;
+    if(ttl_ms != 0) {
+
+        tmp_node->expire_time = ktime_add_ms(tmp_node->enqueue_time, ttl_ms);
+        transaction->expiring_count++;
+    }
+
+    struct message_priority_list* listp = &transaction->lists[list];
+    if(listp->rear == NULL) {
+
+        listp->head = listp->rear = tmp_node;
+    } else {
+
+        listp->rear->next = tmp_node;
+        listp->rear = tmp_node;
+    }
+    __set_bit(list, &transaction->list_bitmap);
+    tmp_node->sequence = transaction->messages_count; /* Its place in the transaction, until the commit */
+    transaction->messages_count++;
+    transaction->messages_size += data->message_size;
+    transaction->messages_footprint += data->footprint;
+    return SUCCESS;
+}
+
+/*
+ * Links a non empty list of staged messages after the messages of the same
+ * list in the queue. Sequences still have to be set one message at a time,
+ * since log positions and walks rely on them growing along every list; the
+ * linking itself is the same whatever the length. The sequences of the
+ * transaction start at first_sequence and follow the order its messages were
+ * written in, across lists too, which is what typed mode reads by.
+ * Must be called with queuep->lock held.
+ */
+static void splice_staged_list(struct message_queue* queuep, struct message_priority_list* staged, unsigned long long first_sequence) {
+
+    struct message_queue_node* tmp_node;
+    for(tmp_node = staged->head; tmp_node != NULL; tmp_node = tmp_node->next) {
+
+        tmp_node->sequence += first_sequence;
+        trace_opsysmem_enqueue(tmp_node->data->message_size, tmp_node->sequence, tmp_node->priority,
+                               queuep->messages_count, queuep->messages_size);
+    }
+
+    /* Linking the first one links the rest, which hang from its next */
+    tmp_node = staged->head;
+    if(queuep->mode == QUEUE_MODE_PRIORITY || queuep->mode == QUEUE_MODE_TYPED) {
+
+        link_priority_node(queuep, tmp_node);
+        queuep->priority_lists[node_list(queuep, tmp_node)].rear = staged->rear;
+    } else if(queuep->mode == QUEUE_MODE_FAIR) {
+
+        link_fair_node(queuep, tmp_node);
+        tmp_node->producer->rear = staged->rear;
+    } else {
+
+        if(queuep->rear == NULL) {
+
+            queuep->head = tmp_node;
+        } else {
+
+            queuep->rear->next = tmp_node;
+        }
+        queuep->rear = staged->rear;
+    }
+}
+
+/* Gives back the room of a transaction and closes it. Must be called with queuep->lock held. */
+static void release_reservation(struct message_queue* queuep, struct message_transaction* transaction) {
+
+    queuep->transactions_count--;
+    queuep->reserved_count -= transaction->max_messages;
+    queuep->reserved_footprint -= transaction->max_footprint;
+}
+
+/*
+ * Makes every message of a transaction readable at once and gives back the
+ * room it did not use. In log and ring mode the oldest messages make room for
+ * them.
+ */
+QUEUE_API void commit_transaction(struct message_queue* queuep, struct message_transaction* transaction) {
+
+    struct message_producer* producer = transaction->producer;
+
+    lock_queue(queuep, LOCK_SITE_ENQUEUE);
+    release_reservation(queuep, transaction);
+    queuep->messages_size += transaction->messages_size;
+    queuep->messages_footprint += transaction->messages_footprint;
+    queuep->messages_count += transaction->messages_count;
+    queuep->expiring_count += transaction->expiring_count;
+    producer->messages_count += transaction->messages_count;
+    producer->messages_footprint += transaction->messages_footprint;
+    if(queuep->messages_count > queuep->high_water_count) {
+
+        queuep->high_water_count = queuep->messages_count;
+    }
+    if(queuep->messages_size > queuep->high_water_size) {
+
+        queuep->high_water_size = queuep->messages_size;
+    }
+    if(queuep->messages_footprint > queuep->high_water_footprint) {
+
+        queuep->high_water_footprint = queuep->messages_footprint;
+    }
+    this_cpu_add(queue_counters.messages_enqueued, transaction->messages_count);
+    this_cpu_add(queue_counters.bytes_enqueued, transaction->messages_size);
+
+    /* At most one list per priority, however many messages */
+    unsigned long long first_sequence = queuep->next_sequence;
+    queuep->next_sequence += transaction->messages_count;
+    unsigned long bitmap = transaction->list_bitmap;
+    while(bitmap != 0) {
+
+        unsigned int list = __fls(bitmap);
+        __clear_bit(list, &bitmap);
+        splice_staged_list(queuep, &transaction->lists[list], first_sequence);
+    }
+
+    if(queuep->mode == QUEUE_MODE_LOG || queuep->mode == QUEUE_MODE_RING) {
+
+        evict_oldest_messages(queuep);
+    }
+    unlock_queue(queuep);
+}
+
+/* Frees every message of a transaction and gives back its room */
+QUEUE_API void abort_transaction(struct message_queue* queuep, struct message_transaction* transaction) {
+
+    struct message_queue_node* dropped = NULL;
+
+    lock_queue(queuep, LOCK_SITE_ENQUEUE);
+    release_reservation(queuep, transaction);
+    unsigned long bitmap = transaction->list_bitmap;
+    while(bitmap != 0) {
+
+        unsigned int list = __fls(bitmap);
+        __clear_bit(list, &bitmap);
+        struct message_priority_list* listp = &transaction->lists[list];
+
+        struct message_queue_node* tmp_node;
+        for(tmp_node = listp->head; tmp_node != NULL; tmp_node = tmp_node->next) {
+
+            uncharge_cgroup_usage(queuep, tmp_node);
+            if(tmp_node->correlation_id != 0) {
+
+                fail_call(queuep, tmp_node->correlation_id);
+            }
+        }
+        listp->rear->next = dropped;
+        dropped = listp->head;
+    }
+    unlock_queue(queuep);
+
+    while(dropped != NULL) {
+
+        struct message_queue_node* next_node = dropped->next;
+        free_node(dropped);
+        dropped = next_node;
+    }
+}
+
+/*
+ * Calls. A call is a message sent with a correlation ID, under which its
+ * reader gets it with dequeue_call. The reply posted with that ID skips the
+ * queue: it goes straight to the reply box of the calling file and wakes only
+ * the tasks waiting there. The calls of a queue are filed in its table, under
+ * its lock, and a call whose message leaves the queue any other way is failed
+ * with -ECANCELED, as no reply can come then.
+ */
+
+QUEUE_API void init_reply_box(struct message_reply_box* box) {
+
+    box->head = box->rear = NULL;
+    box->pending = 0;
+    init_waitqueue_head(&box->wait);
+}
+
+/* Returns the link pointing at the call with the ID, or at NULL. Must be called with queuep->lock held. */
+static struct message_call** find_call(struct message_queue* queuep, unsigned int correlation_id) {
+
+    struct message_call** link = &queuep->call_table[correlation_id & (CALL_BUCKETS - 1)];
+    while(*link != NULL && (*link)->correlation_id != correlation_id) {
+
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+/*
+ * Takes a call out of the table and gives it to its box, where READ_REPLY
+ * finds it, and wakes the tasks waiting there. Must be called with
+ * queuep->lock held, since the box goes away with its file once it is dropped.
+ */
+static void deliver_call(struct message_call** link, int error, struct message_queue_data* reply) {
+
+    struct message_call* call = *link;
+    struct message_reply_box* box = call->box;
+    *link = call->next;
+    call->error = error;
+    call->reply = reply;
+    call->next = NULL;
+    if(box->rear == NULL) {
+
+        box->head = box->rear = call;
+    } else {
+
+        box->rear->next = call;
+        box->rear = call;
+    }
+    box->pending--;
+    wake_up(&box->wait);
+}
+
+/* Fails the call of a message leaving the queue unread by dequeue_call, if it still waits. Must be called with queuep->lock held. */
+static void fail_call(struct message_queue* queuep, unsigned int correlation_id) {
+
+    struct message_call** link = find_call(queuep, correlation_id);
+    if(*link != NULL) {
+
+        deliver_call(link, -ECANCELED, NULL);
+    }
+}
+
+/* Files a call of the given box under an ID no other call has, and returns the ID */
+QUEUE_API unsigned int open_call(struct message_queue* queuep, struct message_call* call, struct message_reply_box* box) {
+
+    lock_queue(queuep, LOCK_SITE_CALL);
+    /* 0 means no call; an ID still waiting after 2^32 calls is skipped */
+    do {
+
+        call->correlation_id = ++queuep->next_correlation_id;
+    } while(call->correlation_id == 0 || *find_call(queuep, call->correlation_id) != NULL);
+
+    struct message_call** bucket = &queuep->call_table[call->correlation_id & (CALL_BUCKETS - 1)];
+    call->box = box;
+    call->error = 0;
+    call->reply = NULL;
+    call->next = *bucket;
+    *bucket = call;
+    box->pending++;
+    unlock_queue(queuep);
+    return call->correlation_id;
+}
+
+/* Takes back a call whose message was never sent; nobody knows its ID, so no reply can have come */
+QUEUE_API void cancel_call(struct message_queue* queuep, struct message_call* call) {
+
+    lock_queue(queuep, LOCK_SITE_CALL);
+    *find_call(queuep, call->correlation_id) = call->next;
+    call->box->pending--;
+    unlock_queue(queuep);
+}
+
+/*
+ * Hands a reply to the file that made the call and wakes the tasks waiting
+ * on it, which then owns the reply. Returns -EINVAL if no call with the ID
+ * is waiting, e.g. because it was replied to already or its file was closed,
+ * -EAGAIN if the reply does not fit in the queue now, or -EMSGSIZE if it
+ * never will.
+ */
+QUEUE_API int post_reply(struct message_queue* queuep, unsigned int correlation_id, struct message_queue_data* reply) {
+
+    lock_queue(queuep, LOCK_SITE_CALL);
+    struct message_call** link = find_call(queuep, correlation_id);
+    if(*link == NULL) {
+
+        unlock_queue(queuep);
+        return -EINVAL;
+    }
+    if(exceeds_limits(queuep, reply->footprint, &queuep->default_producer)) {
+
+        unlock_queue(queuep);
+        return -EMSGSIZE;
+    }
+    if(fits_in_queue(queuep, 0, reply->footprint, &queuep->default_producer) == 0) {
+
+        unlock_queue(queuep);
+        return -EAGAIN;
+    }
+    queuep->replies_footprint += reply->footprint;
+    deliver_call(link, 0, reply);
+    unlock_queue(queuep);
+    return SUCCESS;
+}
+
+/*
+ * Removes the oldest reply of the box into *reply and stores the ID of its
+ * call. Returns the error of a call that failed instead, with its ID as well,
+ * -EAGAIN if calls of the box still wait for a reply, or -EINVAL if none does.
+ */
+QUEUE_API int take_reply(struct message_queue* queuep, struct message_reply_box* box, struct message_queue_data** reply, unsigned int* correlation_id) {
+
+    lock_queue(queuep, LOCK_SITE_CALL);
+    struct message_call* call = box->head;
+    if(call == NULL) {
+
+        int error = box->pending != 0 ? -EAGAIN : -EINVAL;
+        unlock_queue(queuep);
+        return error;
+    }
+    box->head = call->next;
+    if(box->head == NULL) {
+
+        box->rear = NULL;
+    }
+    if(call->reply != NULL) {
+
+        queuep->replies_footprint -= call->reply->footprint;
+    }
+    unlock_queue(queuep);
+
+    int error = call->error;
+    *reply = call->reply;
+    *correlation_id = call->correlation_id;
+    kfree(call);
+    return error;
+}
+
+/*
+ * Forgets the calls of a file being closed, so their replies are refused,
+ * and frees the replies it did not read. Looking for its calls goes through
+ * the whole table, but only for a file that has some.
+ */
+QUEUE_API void close_reply_box(struct message_queue* queuep, struct message_reply_box* box) {
+
+    struct message_call* dropped = NULL;
+
+    lock_queue(queuep, LOCK_SITE_CALL);
+    unsigned int bucket;
+    for(bucket = 0; bucket < CALL_BUCKETS && box->pending != 0; bucket++) {
+
+        struct message_call** link = &queuep->call_table[bucket];
+        while(*link != NULL) {
+
+            struct message_call* call = *link;
+            if(call->box != box) {
+
+                link = &call->next;
+                continue;
+            }
+            *link = call->next;
+            call->next = dropped;
+            dropped = call;
+            box->pending--;
+        }
+    }
+    if(box->rear != NULL) {
+
+        box->rear->next = dropped;
+        dropped = box->head;
+        box->head = box->rear = NULL;
+    }
+    struct message_call* call;
+    for(call = dropped; call != NULL; call = call->next) {
+
+        if(call->reply != NULL) {
+
+            queuep->replies_footprint -= call->reply->footprint;
+        }
+    }
+    unlock_queue(queuep);
+
+    while(dropped != NULL) {
+
+        call = dropped;
+        dropped = call->next;
+        if(call->reply != NULL) {
+
+            free_message_data(call->reply);
+        }
+        kfree(call);
+    }
+}
+
+/*
+ * Walking the queue without removing anything, for debugging.
+ * The lists are visited in the order readers would take them: the main list,
+ * priority lists from the highest, or producers in their current round.
+ * In typed mode they are visited by type from the lowest, as a reader
+ * selecting the lowest type would take them.
+ * All the walk functions must be called with queuep->lock held.
+ */
+
+/* Returns the first node of the list the walk is at */
+static struct message_queue_node* walk_list_head(struct message_queue* queuep, struct message_queue_walk* walkp) {
+
+    if(walkp->mode == QUEUE_MODE_PRIORITY) {
+
+        return queuep->priority_lists[MESSAGE_PRIORITY_LEVELS - 1 - walkp->list].head;
+    }
+    if(walkp->mode == QUEUE_MODE_TYPED) {
+
+        return queuep->priority_lists[walkp->list].head;
+    }
+    if(walkp->mode == QUEUE_MODE_FAIR) {
+
+        return walkp->producer != NULL ? walkp->producer->head : NULL;
+    }
+    return walkp->list == 0 ? queuep->head : NULL;
+}
+
+/* Moves the walk to the next list; returns 0 if there is none */
+static int walk_next_list(struct message_queue* queuep, struct message_queue_walk* walkp) {
+
+    if(walkp->mode == QUEUE_MODE_FAIR) {
+
+        walkp->producer = walkp->producer != NULL ? walkp->producer->next_active : NULL;
+        return walkp->producer != NULL;
+    }
+    walkp->list++;
+    return (walkp->mode == QUEUE_MODE_PRIORITY && walkp->list < MESSAGE_PRIORITY_LEVELS)
+           || (walkp->mode == QUEUE_MODE_TYPED && walkp->list < MESSAGE_TYPES);
+}
+
+/* Returns the first node of the first list from the current one that has any */
+static struct message_queue_node* walk_first_node(struct message_queue* queuep, struct message_queue_walk* walkp) {
+
+    struct message_queue_node* head;
+    while((head = walk_list_head(queuep, walkp)) == NULL) {
+
+        if(walk_next_list(queuep, walkp) == 0) {
+
+            break;
+        }
+    }
+    return walk_to(walkp, head);
+}
+
+static struct message_queue_node* walk_to(struct message_queue_walk* walkp, struct message_queue_node* tmp_node) {
+
+    walkp->node = tmp_node;
+    if(tmp_node != NULL) {
+
+        walkp->sequence = tmp_node->sequence;
+    }
+    return tmp_node;
+}
+
+/* Starts a walk at the message readers would get first; NULL if the queue is empty */
+QUEUE_API struct message_queue_node* start_queue_walk(struct message_queue* queuep, struct message_queue_walk* walkp) {
+
+    walkp->mode = queuep->mode;
+    walkp->list = 0;
+    walkp->producer = queuep->active_head;
+    walkp->node = NULL;
+    walkp->sequence = 0;
+    walkp->generation = queuep->requeue_generation;
+    return walk_first_node(queuep, walkp);
+}
+
+/* Moves the walk past its node; NULL at the end */
+QUEUE_API struct message_queue_node* next_queue_walk(struct message_queue* queuep, struct message_queue_walk* walkp) {
+
+    if(walkp->node == NULL) {
+
+        return NULL;
+    }
+    if(walkp->node->next != NULL) {
+
+        return walk_to(walkp, walkp->node->next);
+    }
+    if(walk_next_list(queuep, walkp) == 0) {
+
+        return walk_to(walkp, NULL);
+    }
+    return walk_first_node(queuep, walkp);
+}
+
+/*
+ * Returns the node the walk stopped at, after the lock was taken again.
+ * If it was removed meanwhile, so was everything before it in its list, and
+ * the walk goes on with what is left. The walk ends if the mode changed, or
+ * in fair mode if its producer has run out of messages, since the round it
+ * was following is gone.
+ */
+QUEUE_API struct message_queue_node* resume_queue_walk(struct message_queue* queuep, struct message_queue_walk* walkp) {
+
+    if(walkp->node == NULL || walkp->mode != queuep->mode) {
+
+        return walk_to(walkp, NULL);
+    }
+
+    if(walkp->mode == QUEUE_MODE_FAIR) {
+
+        struct message_producer* producer = queuep->active_head;
+        while(producer != NULL && producer != walkp->producer) {
+
+            producer = producer->next_active;
+        }
+        if(producer == NULL) {
+
+            return walk_to(walkp, NULL);
+        }
+    }
+
+    struct message_queue_node* head = walk_list_head(queuep, walkp);
+    if(walkp->generation != queuep->requeue_generation) {
+
+        /* Older messages came back, so the head says nothing about the node; look for its sequence */
+        walkp->generation = queuep->requeue_generation;
+        while(head != NULL && head->sequence < walkp->sequence) {
+
+            head = head->next;
+        }
+    } else if(head != NULL && head->sequence <= walkp->sequence) {
+
+        return walkp->node;
+    }
+    if(head != NULL) {
+
+        return walk_to(walkp, head);
+    }
+    if(walk_next_list(queuep, walkp) == 0) {
+
+        return walk_to(walkp, NULL);
+    }
+    return walk_first_node(queuep, walkp);
+}
+
+/*
+ * Copies the message at the file position to the user without removing it
+ * and advances the position past it. Positions older than the oldest retained
+ * message continue from the oldest one. Returns -EAGAIN if the reader has
+ * caught up with the writers.
+ */
+QUEUE_API ssize_t read_log_message(struct message_queue* queuep, struct message_log_cursor* cursorp, char* buffer, size_t length, loff_t* offset) {
+
+    if(queuep == NULL) {
+
+        return -EAGAIN;
+    }
+
+    lock_queue(queuep, LOCK_SITE_LOG);
+    if(queuep->head == NULL) {
+
+        unlock_queue(queuep);
+        return -EAGAIN;
+    }
+
+    unsigned long long sequence = *offset;
+    if(sequence < queuep->head->sequence) {
+
+        sequence = queuep->head->sequence;
+    }
+
+    /*
+     * Messages only ever leave from the head, so the last node we read is
+     * still in the queue as long as its sequence is not older than the head.
+     * A timed out message put back near the head, or a change of mode, breaks
+     * that; both change requeue_generation.
+     */
+    struct message_queue_node* tmp_node = NULL;
+    if(cursorp->last_read_node != NULL && cursorp->last_read_sequence + 1 == sequence
+            && cursorp->generation == queuep->requeue_generation
+            && cursorp->last_read_sequence >= queuep->head->sequence) {
+
+        tmp_node = cursorp->last_read_node->next;
+    } else {
+
+        tmp_node = queuep->head;
+        while(tmp_node != NULL && tmp_node->sequence < sequence) {
+
+            tmp_node = tmp_node->next;
+        }
+    }
+
+    if(tmp_node == NULL) {
+
+        unlock_queue(queuep);
+        return -EAGAIN;
+    }
+
+    /*
+     * The user buffer may fault, so the copy is done without the lock. The
+     * reference keeps the message alive if it is evicted meanwhile, and the
+     * cursor only leads to the node while the offset still follows it.
+     */
+    struct message_queue_data* tmp_data = tmp_node->data;
+    refcount_inc(&tmp_data->users);
+    sequence = tmp_node->sequence;
+    cursorp->last_read_node = tmp_node;
+    cursorp->last_read_sequence = sequence;
+    cursorp->generation = queuep->requeue_generation;
+    trace_opsysmem_log_read(tmp_data->message_size, tmp_node->sequence, tmp_node->priority,
+                            queuep->messages_count, queuep->messages_size);
+    unlock_queue(queuep);
+
+    ssize_t bytes_read = copy_message_to_user(tmp_data, buffer, length);
+    if(bytes_read >= 0) {
+
+        this_cpu_inc(queue_counters.log_reads);
+        *offset = sequence + 1;
+    }
+    free_message_data(tmp_data);
+    return bytes_read;
+}
+
+/* Returns 1 if there is a retained message at or after the given position */
+QUEUE_API int is_log_message_available(struct message_queue* queuep, loff_t offset) {
+
+    if(queuep == NULL) {
+
+        return -1;
+    }
+
+    lock_queue(queuep, LOCK_SITE_LOG);
+
+    if(queuep->rear != NULL && queuep->rear->sequence >= offset) {
+
+        unlock_queue(queuep);
+        return 1;
+    }
+
+    unlock_queue(queuep);
+    return 0;
+}
+
+/*
+ * Computes the new position of a log reader.
+ * Only retained sequences and the next sequence to be written are valid.
+ */
+QUEUE_API loff_t seek_log(struct message_queue* queuep, loff_t offset, int whence, loff_t position) {
+
+    if(queuep == NULL) {
+
+        return -EINVAL;
+    }
+
+    lock_queue(queuep, LOCK_SITE_LOG);
+
+    loff_t new_position;
+    switch(whence) {
+
+        case SEEK_SET:
+            new_position = offset;
+            break;
+        case SEEK_CUR:
+            new_position = position + offset;
+            break;
+        case SEEK_END:
+            new_position = queuep->next_sequence + offset;
+            break;
+        default:
+            unlock_queue(queuep);
+            return -EINVAL;
+    }
+
+    unsigned long long oldest_sequence = queuep->next_sequence;
+    if(queuep->head != NULL) {
+
+        oldest_sequence = queuep->head->sequence;
+    }
+
+    if(new_position < 0 || new_position < oldest_sequence || new_position > queuep->next_sequence) {
+
+        unlock_queue(queuep);
+        return -EINVAL;
+    }
+
+    unlock_queue(queuep);
+    return new_position;
+}
+
+/*
+ * Copies a stored message to user space, stopping at the first null byte or
+ * after length bytes. Returns the number of bytes copied or -EFAULT.
+ */
+QUEUE_API ssize_t copy_message_to_user(struct message_queue_data* data, char* buffer, size_t length) {
+
+    ssize_t bytes_read = 0;
+
+    /* Ensures we send to the user the specific message */
+    unsigned long tmp_length = 0;
+    if(data->message_size >= length) {
+
+        tmp_length = length;
+    } else {
+
+        tmp_length = data->message_size;
+    }
+
+    /* Copy one contiguous chunk of the message at a time */
+    while(tmp_length) {
+
+        unsigned long chunk_length = 0;
+        char* chunk = message_chunk(data, bytes_read, &chunk_length);
+        if(chunk_length > tmp_length) {
+
+            chunk_length = tmp_length;
+        }
+
+        /* As long as we did not hit null byte */
+        char* null_byte = memchr(chunk, '\0', chunk_length);
+        if(null_byte != NULL) {
+
+            chunk_length = null_byte - chunk;
+        }
+
+        /* Move the message from kernel space to user space */
+        if(copy_to_user(buffer + bytes_read, chunk, chunk_length) != 0) {
+
+            return -EFAULT;
+        }
+
+        tmp_length -= chunk_length;
+        bytes_read += chunk_length;
+        if(null_byte != NULL) {
+
+            break;
+        }
+    }
+    return bytes_read;
+}
+
+/* Copies length bytes from user space into freshly allocated message storage */
+QUEUE_API int copy_message_from_user(struct message_queue_data* data, const char* buffer, unsigned long length) {
+
+    unsigned long bytes_written = 0;
+    while(bytes_written < length) {
+
+        unsigned long chunk_length = 0;
+        char* chunk = message_chunk(data, bytes_written, &chunk_length);
+        if(chunk_length > length - bytes_written) {
+
+            chunk_length = length - bytes_written;
+        }
+
+        if(copy_from_user(chunk, buffer + bytes_written, chunk_length) != 0) {
+
+            return -EFAULT;
+        }
+        bytes_written += chunk_length;
+    }
+    return SUCCESS;
+}
@@ -0,0 +1,311 @@
+/**
+ * @file messageQueue.h
+ * @author Alexandru Blinda
+ * @date 6 November 2017
+ * @version 0.1
+ * @brief Header file that declares the message queue and operations on it.
+ * Part of exercise 3 for Operating Systems Module (creating a character device
+ * driver).
+ */
+#ifndef MESSAGEQUEUE_H
+#define MESSAGEQUEUE_H
+
+#include "charDeviceDriverIoctl.h"
+
+#if MESSAGE_TYPES != MESSAGE_PRIORITY_LEVELS
+#error "Typed mode keeps the messages of each type in one of the priority lists"
+#endif
+
+#define DEFAULT_MAX_MESSAGES_SIZE 2097152 /* 2MiB of footprint in bytes; changed with CHANGE_MAX_MESSAGES_SIZE */
+#define DEFAULT_VISIBILITY_TIMEOUT_MS 30000 /* Changed with CHANGE_VISIBILITY_TIMEOUT */
+#define INFLIGHT_HASH_BITS 10 /* The table of received messages has 1 << INFLIGHT_HASH_BITS buckets */
+#define INFLIGHT_BUCKETS (1 << INFLIGHT_HASH_BITS)
+#define FAIR_QUANTUM 4096 /* Footprint a producer may have dequeued per round in fair mode */
+#define EXPIRY_BATCH 64 /* Expired messages reap_expired_messages takes per hold of the lock */
+#define DELAY_BATCH 64 /* Due messages promote_delayed_messages links per hold of the lock */
+#define REDELIVERY_BATCH 64 /* Timed out messages requeue_timed_out_messages returns per hold of the lock */
+#define CALL_HASH_BITS 8
+#define CALL_BUCKETS (1 << CALL_HASH_BITS) /* Correlation IDs are consecutive, so the low bits spread them evenly */
+
+/* Places that take the queue lock, told apart by the lock statistics */
+#define LOCK_SITE_RELEASE 0 /* release_queue */
+#define LOCK_SITE_ENQUEUE 1
+#define LOCK_SITE_DEQUEUE 2
+#define LOCK_SITE_IS_EMPTY 3 /* is_queue_empty */
+#define LOCK_SITE_IS_SPACE 4 /* is_space_in_queue */
+#define LOCK_SITE_LOG 5 /* read_log_message, is_log_message_available and seek_log */
+#define LOCK_SITE_IOCTL 6 /* device_ioctl in the drivers */
+#define LOCK_SITE_DEBUGFS 7 /* debugfs files showing the queue */
+#define LOCK_SITE_REAP 8 /* reap_expired_messages */
+#define LOCK_SITE_PROMOTE 9 /* promote_delayed_messages */
+#define LOCK_SITE_ACK 10 /* receive_message, ack_message and requeue_timed_out_messages */
+#define LOCK_SITE_RENDEZVOUS 11 /* Offers of writers in rendezvous mode, in the blocking driver */
+#define LOCK_SITE_CALL 12 /* Calls and their replies */
+#define LOCK_SITES 13
+
+/*
+ * The drivers include messageQueue.c, so its functions are static to each module.
+ * The user space library defines QUEUE_API as empty to export them.
+ */
+#ifndef QUEUE_API
+#define QUEUE_API static
+#endif
+
+/* Declaring queue struct and operations on it */
+
+/* Struct to hold the message and the message size */
+struct message_queue_data {
+
+    union { /* Which one is used follows from message_size */
+
+        char* message; /* The stored message, if it fits in one page */
+        struct page** pages; /* Otherwise the pages holding it, PAGE_SIZE bytes each */
+    };
+    unsigned long message_size; /* Up to MAX_MESSAGE_SIZE_LIMIT */
+    unsigned long footprint; /* Memory the message takes once enqueued, see message_footprint */
+    refcount_t users; /* Its owner, plus log readers copying it out without the queue lock */
+};
+
+/*
+ * Struct to hold what the messages written from one cgroup take in the queue.
+ * The queue keeps one for every cgroup with messages in it.
+ */
+struct message_cgroup_usage {
+
+    unsigned long long cgroup_id; /* Inode number of the cgroup v2 directory */
+    unsigned long messages_count;
+    unsigned long messages_footprint;
+    struct message_cgroup_usage* next;
+};
+
+/*
+ * Struct to represent whoever writes messages, usually an open file.
+ * It lives while its file is open or it has messages in the queue.
+ */
+struct message_producer {
+
+    struct message_queue_node* head; /* Its messages, in fair mode only */
+    struct message_queue_node* rear;
+    struct message_producer* next_active; /* Next producer with messages in fair mode */
+    unsigned long messages_count; /* Its messages in the queue, in every mode */
+    unsigned long messages_footprint;
+    unsigned long quota; /* Most footprint it may have queued; 0 for no limit */
+    unsigned long deficit; /* Footprint it may still have dequeued this round in fair mode */
+    int open; /* Cleared when the file is closed */
+};
+
+/* Struct to represent the node of a queue (data and next element) */
+struct message_queue_node {
+
+    struct message_queue_data* data;
+    union {
+
+        struct {
+
+            struct message_queue_node* next;
+            unsigned long long sequence; /* Position of the message in the stream of all messages ever written */
+        };
+        struct { /* While the message is delayed it is in the heap of delayed messages instead */
+
+            struct message_queue_node* delayed_child;
+            struct message_queue_node* delayed_sibling;
+        };
+    };
+    unsigned char priority; /* From 0 to MESSAGE_PRIORITY_LEVELS - 1, higher is read first */
+    unsigned char type; /* From 0 to MESSAGE_TYPES - 1, selected on by dequeue_type */
+    unsigned char deliveries; /* Times it was handed out by receive_message */
+    unsigned int correlation_id; /* Call the message makes, which a reply names; 0 if it is not a call */
+    ktime_t enqueue_time; /* When the message was linked into the queue, or is due while delayed */
+    ktime_t expire_time; /* When its time to live is over; 0 if it has none */
+    struct message_cgroup_usage* usage; /* Cgroup of the writer */
+    struct message_producer* producer; /* Who wrote it */
+};
+
+/*
+ * Struct to hold a message received with receive_message until it is
+ * acknowledged or its visibility timeout is over. The message keeps its room
+ * in the queue meanwhile.
+ */
+struct message_inflight {
+
+    unsigned long long receipt; /* Given to the reader; unique to this delivery */
+    ktime_t deadline; /* When the message goes back to the queue */
+    struct message_queue_node* node;
+    struct message_inflight* hash_next; /* Next in the same bucket of the in-flight table */
+    struct message_inflight* previous; /* Neighbours in deadline order */
+    struct message_inflight* next;
+};
+
+struct message_reply_box;
+
+/* Struct to hold a call waiting for its reply, then the reply, or why none comes, waiting to be read */
+struct message_call {
+
+    unsigned int correlation_id;
+    int error; /* 0, or -ECANCELED once its message was dropped without READ_CALL taking it */
+    struct message_reply_box* box; /* Of the calling file */
+    struct message_queue_data* reply; /* NULL until the reply comes */
+    struct message_call* next; /* Next in the same bucket of the call table, then next reply in the box */
+};
+
+/* Struct to hold the replies to the calls of one file */
+struct message_reply_box {
+
+    struct message_call* head; /* Replies not read yet, the oldest first */
+    struct message_call* rear;
+    unsigned long pending; /* Calls not replied to yet */
+    wait_queue_head_t wait; /* Readers of the replies; woken by every reply */
+};
+
+/* Struct to hold the oldest and newest message of one priority */
+struct message_priority_list {
+
+    struct message_queue_node* head;
+    struct message_queue_node* rear;
+};
+
+/* Struct to represent the queue - it holds the head of the queue and the size */
+struct message_queue {
+
+    struct message_queue_node* head;
+    struct message_queue_node* rear;
+    struct mutex lock; /* Held while the queue is read or modified; taken with lock_queue */
+    unsigned long long lock_contentions; /* Times lock_queue found the lock held */
+    unsigned long long lock_wait_ns; /* Time spent waiting in those times */
+    ktime_t lock_acquired; /* When the holder took the lock, if lock statistics are enabled */
+    int lock_site; /* LOCK_SITE_* of the holder, if lock statistics are enabled */
+    unsigned long max_messages_size; /* Most footprint of messages the queue holds */
+    unsigned long max_messages_count; /* Most messages the queue holds; 0 for no limit */
+    unsigned long messages_size; /* Size of all messages stored in queue*/
+    unsigned long messages_footprint; /* Memory taken by all messages stored in queue */
+    unsigned long messages_count; /* Number of messages stored in queue */
+    unsigned long high_water_count; /* Largest messages_count so far */
+    unsigned long high_water_size; /* Largest messages_size so far */
+    unsigned long high_water_footprint; /* Largest messages_footprint so far */
+    unsigned long long next_sequence; /* Sequence number given to the next enqueued message */
+    int mode; /* One of the QUEUE_MODE_* values */
+    struct message_priority_list priority_lists[MESSAGE_PRIORITY_LEVELS]; /* Used instead of head and rear in priority mode, and one per type in typed mode */
+    unsigned long priority_bitmap; /* Bit p is set while priority_lists[p] is not empty */
+    struct message_cgroup_usage* cgroup_usage; /* One per cgroup with messages in the queue */
+    struct message_cgroup_usage* spare_usage; /* Kept when a queue empties, so it is not reallocated every message */
+    struct message_producer default_producer; /* Writer of messages enqueued without a producer */
+    struct message_producer* active_head; /* Producers with messages in fair mode, next to be read first */
+    struct message_producer* active_rear;
+    unsigned long expiring_count; /* Messages with a time to live */
+    struct message_queue_node* delayed_root; /* Pairing heap of messages not due yet, the first due at the root */
+    unsigned long delayed_count; /* Messages in the heap; counted in messages_count as well */
+    unsigned long delayed_footprint;
+    ktime_t next_due; /* When the root is due; 0 if there is no delayed message */
+    struct message_inflight* inflight_table[INFLIGHT_BUCKETS]; /* Received messages not acknowledged yet, by receipt */
+    struct message_inflight* inflight_head; /* The same, the first to time out first */
+    struct message_inflight* inflight_rear;
+    unsigned long inflight_count; /* Counted in messages_count as well */
+    unsigned long inflight_footprint;
+    unsigned long long next_receipt;
+    unsigned long visibility_timeout_ms; /* How long a received message waits for its acknowledgement */
+    ktime_t next_timeout; /* Deadline of inflight_head; 0 if nothing is in flight */
+    unsigned long requeue_generation; /* Changes whenever messages go back into the lists, and with the mode */
+    unsigned int max_deliveries; /* Receptions after which a message is dropped instead of put back; 0 for no limit */
+    struct message_queue* dead_letters; /* Where dropped messages go, if not NULL; expired or received too often */
+    int holds_dead_letters; /* Set on a dead letter queue, whose reads are not counted as traffic */
+    unsigned long transactions_count; /* Open transactions; the mode cannot change while there are any */
+    unsigned long reserved_count; /* Room they reserved, not taken by anything else meanwhile */
+    unsigned long reserved_footprint;
+    struct rendezvous_offer* offers_head; /* Writers waiting in rendezvous mode, the oldest first */
+    struct rendezvous_offer* offers_rear;
+    struct message_call* call_table[CALL_BUCKETS]; /* Calls of messages in the queue not replied to yet, by correlation ID */
+    unsigned int next_correlation_id;
+    unsigned long replies_footprint; /* Replies waiting in reply boxes, which take room like messages */
+};
+
+/*
+ * Struct to hold the messages written in a transaction until it commits.
+ * They are kept in lists the way the mode of the queue links them, so the
+ * commit splices each list whole.
+ */
+struct message_transaction {
+
+    struct message_priority_list lists[MESSAGE_PRIORITY_LEVELS]; /* One per priority in priority mode, per type in typed mode; otherwise only lists[0] */
+    unsigned long list_bitmap; /* Bit p is set while lists[p] is not empty */
+    struct message_producer* producer; /* Writer of all its messages */
+    unsigned long max_messages; /* Room reserved in the queue when it began */
+    unsigned long max_footprint;
+    unsigned long messages_count; /* What its messages take of that room */
+    unsigned long messages_size;
+    unsigned long messages_footprint;
+    unsigned long expiring_count; /* Its messages with a time to live */
+};
+
+/*
+ * Struct to remember the last node a log mode reader read, so a reader
+ * consuming sequentially finds its next message without walking the queue.
+ * The node is only trusted while its sequence is still retained and no
+ * message went back into the list since, as with walks.
+ */
+struct message_log_cursor {
+
+    struct message_queue_node* last_read_node;
+    unsigned long long last_read_sequence;
+    unsigned long generation; /* requeue_generation of the queue when last_read_node was read */
+};
+
+/*
+ * Struct to remember where a walk over every queued message stopped, so it
+ * can go on after the queue lock was dropped. Messages only ever leave a list
+ * from its head and sequences grow along a list, so the node is still there
+ * exactly while its list starts at or before its sequence. Timed out messages
+ * going back into a list break that, so then the walk looks for its sequence.
+ */
+struct message_queue_walk {
+
+    int mode; /* Mode of the queue when the walk started; it ends if that changes */
+    unsigned int list; /* Which list: the main one, or priority lists from the highest */
+    struct message_producer* producer; /* Whose list, in fair mode */
+    struct message_queue_node* node; /* Next node to visit, NULL at the end */
+    unsigned long long sequence; /* Sequence of node */
+    unsigned long generation; /* requeue_generation the position was taken at */
+};
+
+QUEUE_API struct message_queue* initialise_queue(void);
+QUEUE_API void release_queue(struct message_queue*);
+QUEUE_API void lock_queue(struct message_queue*, int);
+QUEUE_API void unlock_queue(struct message_queue*);
+QUEUE_API unsigned long message_footprint(unsigned long);
+QUEUE_API struct message_queue_data* alloc_message_data(unsigned long);
+QUEUE_API void free_message_data(struct message_queue_data*);
+QUEUE_API struct message_producer* open_producer(struct message_queue*);
+QUEUE_API void close_producer(struct message_queue*, struct message_producer*);
+QUEUE_API int enqueue(struct message_queue*, struct message_queue_data*, unsigned int, unsigned int, unsigned long, ktime_t, unsigned int, struct message_producer*);
+QUEUE_API struct message_queue_data* dequeue(struct message_queue*);
+QUEUE_API struct message_queue_data* dequeue_call(struct message_queue*, unsigned int*);
+QUEUE_API struct message_queue_data* dequeue_type(struct message_queue*, unsigned int, int, unsigned int*);
+QUEUE_API unsigned long reap_expired_messages(struct message_queue*);
+QUEUE_API unsigned long promote_delayed_messages(struct message_queue*);
+QUEUE_API ssize_t receive_message(struct message_queue*, struct message_inflight*, char*, size_t, unsigned long long*);
+QUEUE_API int ack_message(struct message_queue*, unsigned long long);
+QUEUE_API unsigned long requeue_timed_out_messages(struct message_queue*);
+QUEUE_API int begin_transaction(struct message_queue*, struct message_transaction*, struct message_producer*, unsigned long, unsigned long);
+QUEUE_API int stage_message(struct message_queue*, struct message_transaction*, struct message_queue_data*, unsigned int, unsigned int, unsigned long, unsigned int);
+QUEUE_API void commit_transaction(struct message_queue*, struct message_transaction*);
+QUEUE_API void abort_transaction(struct message_queue*, struct message_transaction*);
+QUEUE_API void init_reply_box(struct message_reply_box*);
+QUEUE_API unsigned int open_call(struct message_queue*, struct message_call*, struct message_reply_box*);
+QUEUE_API void cancel_call(struct message_queue*, struct message_call*);
+QUEUE_API int post_reply(struct message_queue*, unsigned int, struct message_queue_data*);
+QUEUE_API int take_reply(struct message_queue*, struct message_reply_box*, struct message_queue_data**, unsigned int*);
+QUEUE_API void close_reply_box(struct message_queue*, struct message_reply_box*);
+QUEUE_API int is_queue_empty(struct message_queue*);
+QUEUE_API int is_type_available(struct message_queue*, unsigned int, int);
+QUEUE_API int is_space_in_queue(struct message_queue*, unsigned long, struct message_producer*);
+QUEUE_API int resize_queue(struct message_queue*, unsigned long);
+QUEUE_API int set_max_messages_count(struct message_queue*, unsigned long);
+QUEUE_API ssize_t copy_message_to_user(struct message_queue_data*, char*, size_t);
+QUEUE_API int copy_message_from_user(struct message_queue_data*, const char*, unsigned long);
+QUEUE_API ssize_t read_log_message(struct message_queue*, struct message_log_cursor*, char*, size_t, loff_t*);
+QUEUE_API int is_log_message_available(struct message_queue*, loff_t);
+QUEUE_API loff_t seek_log(struct message_queue*, loff_t, int, loff_t);
+QUEUE_API struct message_queue_node* start_queue_walk(struct message_queue*, struct message_queue_walk*);
+QUEUE_API struct message_queue_node* next_queue_walk(struct message_queue*, struct message_queue_walk*);
+QUEUE_API struct message_queue_node* resume_queue_walk(struct message_queue*, struct message_queue_walk*);
+
+#endif
@@ -0,0 +1,441 @@
+/**
+ * @file messageQueue_kunit.c
+ * @author Alexandru Blinda
+ * @date 6 November 2017
+ * @version 0.1
+ * @brief KUnit suite for the message queue both drivers share.
+ * It builds messageQueue.c the way the drivers do and checks its order, its
+ * limits while kthreads race to fill it and limits lowered as far as what is
+ * queued. The timed cases run the in-kernel benchmark and fail when an
+ * enqueue or dequeue costs more than max_op_ns on average.
+ * With this directory in a kernel tree and its Kconfig sourced, run it with
+ * 'tools/testing/kunit/kunit.py run --kunitconfig=<this directory>'.
+ * Part of exercise 3 for Operating Systems Module (creating a character device
+ * driver).
+ */
+#include <kunit/test.h> /* KUnit test cases and expectations */
+#include <linux/module.h> /* Core headers for loading LKMs into the kernel */
+#include <linux/kernel.h> /* Functions, types, macros for the kernel */
+#include <linux/fs.h> /* Linux file support */
+#include <asm/uaccess.h> /* Copy to / from user space */
+#include <linux/slab.h> /* Header for kmalloc and kfree functions */
+#include <linux/string.h> /* For memcpy, memset, sprintf */
+#include <linux/mutex.h> /* Required for mutex functionality */
+#include <linux/gfp.h> /* For alloc_page and __free_page */
+#include <linux/mm.h> /* For page_address */
+#include <linux/ktime.h> /* For stamping messages with ktime_get */
+#include <linux/refcount.h> /* Log readers keep a message alive while copying it out */
+#include <linux/wait.h> /* Reply boxes wake the tasks waiting for a reply */
+#include <linux/atomic.h> /* Counting the enqueues of racing kthreads */
+#include <linux/delay.h> /* msleep, for a time to live to pass */
+
+/* What the drivers take from charDeviceDriver.h, which also declares their file operations */
+#define PRINTING_NAME "MessageQueueKunit"
+#define SUCCESS 0
+#define DEVICE_NAME "opsysmem_kunit" /* Names the kthreads of the benchmark */
+#define MAX_MESSAGE_SIZE_LIMIT 1048576 /* As in charDeviceDriver.h */
+#define TEST_MESSAGE_SIZE 64
+#define RACE_THREADS 4
+#define RACE_ATTEMPTS 64 /* Enqueues every racing kthread tries */
+#define RACE_LIMIT 16 /* Messages that fit in the queue of the race */
+#define TIMED_DURATION_MS 200
+#define TIMED_THREADS 4 /* For the contended timed case */
+
+#include "messageQueue.h"
+#include "charDeviceDriverStats.h"
+#define CREATE_TRACE_POINTS
+#include "charDeviceDriverTrace.h"
+#include "messageQueue.c" /* The queue itself, static to this module as to the drivers */
+#include "charDeviceDriverSelfbench.h"
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Alexandru Blinda");
+MODULE_DESCRIPTION("KUnit tests for the message queue of the opsysmem drivers");
+MODULE_VERSION("0.1");
+
+static unsigned int max_op_ns = 20000;
+module_param(max_op_ns, uint, 0644);
+MODULE_PARM_DESC(max_op_ns, "Most average nanoseconds an uncontended enqueue or dequeue may take; 0 skips the case");
+static unsigned int max_contended_op_ns = 200000;
+module_param(max_contended_op_ns, uint, 0644);
+MODULE_PARM_DESC(max_contended_op_ns, "The same with TIMED_THREADS kthreads sharing the queue; 0 skips the case");
+
+/* Struct to hold what one racing kthread did */
+struct race_thread {
+
+    struct message_queue* queuep;
+    struct completion* start; /* Completed for all of them at once */
+    atomic_t* enqueued; /* Shared by all of them */
+    struct completion done;
+};
+
+static int init_queue_test(struct kunit* test);
+static void exit_queue_test(struct kunit* test);
+static struct message_queue_data* make_message(unsigned int tag);
+static unsigned int message_tag(struct message_queue_data* data);
+static int race_thread_fn(void* arg);
+static void check_op_cost(struct kunit* test, unsigned int threads, unsigned int threshold_ns);
+
+/* Every case gets a queue of its own in test->priv */
+static int init_queue_test(struct kunit* test) {
+
+    struct message_queue* queuep = initialise_queue();
+    if(queuep == NULL) {
+
+        return -ENOMEM;
+    }
+    test->priv = queuep;
+    return 0;
+}
+
+static void exit_queue_test(struct kunit* test) {
+
+    release_queue(test->priv);
+}
+
+/* Allocates a message whose first bytes hold the tag, or returns NULL */
+static struct message_queue_data* make_message(unsigned int tag) {
+
+    struct message_queue_data* tmp_data = alloc_message_data(TEST_MESSAGE_SIZE);
+    if(tmp_data != NULL) {
+
+        memset(tmp_data->message, 0, TEST_MESSAGE_SIZE);
+        memcpy(tmp_data->message, &tag, sizeof(tag));
+    }
+    return tmp_data;
+}
+
+static unsigned int message_tag(struct message_queue_data* data) {
+
+    unsigned int tag;
+    memcpy(&tag, data->message, sizeof(tag));
+    return tag;
+}
+
+/* Messages come out in the order they went in, and the totals go back to 0 */
+static void test_fifo_order(struct kunit* test) {
+
+    struct message_queue* queuep = test->priv;
+    unsigned int i;
+
+    for(i = 0; i < 32; i++) {
+
+        struct message_queue_data* tmp_data = make_message(i);
+        KUNIT_ASSERT_NOT_NULL(test, tmp_data);
+        KUNIT_ASSERT_EQ(test, enqueue(queuep, tmp_data, 0, 0, 0, 0, 0, NULL), SUCCESS);
+    }
+    KUNIT_EXPECT_EQ(test, queuep->messages_count, 32UL);
+    KUNIT_EXPECT_EQ(test, queuep->messages_size, 32UL * TEST_MESSAGE_SIZE);
+
+    for(i = 0; i < 32; i++) {
+
+        struct message_queue_data* tmp_data = dequeue(queuep);
+        KUNIT_ASSERT_NOT_NULL(test, tmp_data);
+        KUNIT_EXPECT_EQ(test, message_tag(tmp_data), i);
+        KUNIT_EXPECT_EQ(test, tmp_data->message_size, (unsigned long) TEST_MESSAGE_SIZE);
+        free_message_data(tmp_data);
+    }
+    KUNIT_EXPECT_NULL(test, dequeue(queuep));
+    KUNIT_EXPECT_EQ(test, is_queue_empty(queuep), 1);
+    KUNIT_EXPECT_EQ(test, queuep->messages_count, 0UL);
+    KUNIT_EXPECT_EQ(test, queuep->messages_footprint, 0UL);
+}
+
+/* Body of every racing kthread: enqueue as fast as it can once all are started */
+static int race_thread_fn(void* arg) {
+
+    struct race_thread* threadp = arg;
+    unsigned int i;
+
+    wait_for_completion(threadp->start);
+    for(i = 0; i < RACE_ATTEMPTS; i++) {
+
+        struct message_queue_data* tmp_data = make_message(i);
+        if(tmp_data == NULL) {
+
+            break;
+        }
+        if(enqueue(threadp->queuep, tmp_data, 0, 0, 0, 0, 0, NULL) != SUCCESS) {
+
+            free_message_data(tmp_data);
+            continue;
+        }
+        atomic_inc(threadp->enqueued);
+    }
+
+    /* Do not return into the module after waking the test; it may be unloaded */
+    kthread_complete_and_exit(&threadp->done, 0);
+}
+
+/*
+ * Kthreads racing to enqueue into a queue with room for RACE_LIMIT messages
+ * get exactly that many in: the check and the enqueue are one step under the
+ * queue lock, so two writers cannot both take the last room.
+ */
+static void test_capacity_race(struct kunit* test) {
+
+    struct message_queue* queuep = test->priv;
+    struct race_thread threads[RACE_THREADS];
+    struct completion start;
+    atomic_t enqueued = ATOMIC_INIT(0);
+    unsigned int started;
+
+    KUNIT_ASSERT_EQ(test, resize_queue(queuep, RACE_LIMIT * message_footprint(TEST_MESSAGE_SIZE)), SUCCESS);
+    init_completion(&start);
+    for(started = 0; started < RACE_THREADS; started++) {
+
+        struct race_thread* threadp = &threads[started];
+        threadp->queuep = queuep;
+        threadp->start = &start;
+        threadp->enqueued = &enqueued;
+        init_completion(&threadp->done);
+
+        struct task_struct* task = kthread_run(race_thread_fn, threadp, "%s_race/%u", DEVICE_NAME, started);
+        if(IS_ERR(task)) {
+
+            break;
+        }
+    }
+    complete_all(&start);
+
+    unsigned int i;
+    for(i = 0; i < started; i++) {
+
+        wait_for_completion(&threads[i].done);
+    }
+    KUNIT_ASSERT_EQ(test, started, RACE_THREADS);
+    KUNIT_EXPECT_EQ(test, atomic_read(&enqueued), RACE_LIMIT);
+    KUNIT_EXPECT_EQ(test, queuep->messages_count, (unsigned long) RACE_LIMIT);
+    KUNIT_EXPECT_LE(test, queuep->messages_footprint, queuep->max_messages_size);
+    KUNIT_EXPECT_EQ(test, is_space_in_queue(queuep, TEST_MESSAGE_SIZE, NULL), 0);
+}
+
+/*
+ * The limits cannot be lowered below what is queued, as the ioctls would
+ * otherwise leave writers waiting on room nothing can make. Once lowered as
+ * far as they go, the queue is full until a read makes room, and nothing
+ * queued is lost on the way.
+ */
+static void test_resize_below_usage(struct kunit* test) {
+
+    struct message_queue* queuep = test->priv;
+    struct message_transaction transaction;
+    unsigned long footprint = message_footprint(TEST_MESSAGE_SIZE);
+    unsigned long max_messages_size = queuep->max_messages_size;
+    unsigned int i;
+
+    for(i = 0; i < 4; i++) {
+
+        struct message_queue_data* tmp_data = make_message(i);
+        KUNIT_ASSERT_NOT_NULL(test, tmp_data);
+        KUNIT_ASSERT_EQ(test, enqueue(queuep, tmp_data, 0, 0, 0, 0, 0, NULL), SUCCESS);
+    }
+
+    KUNIT_EXPECT_EQ(test, resize_queue(queuep, 2 * footprint), -EINVAL);
+    KUNIT_EXPECT_EQ(test, resize_queue(queuep, 4 * footprint), -EINVAL);
+    KUNIT_EXPECT_EQ(test, queuep->max_messages_size, max_messages_size);
+    KUNIT_EXPECT_EQ(test, set_max_messages_count(queuep, 3), -EINVAL);
+    KUNIT_EXPECT_EQ(test, queuep->max_messages_count, 0UL);
+
+    /* As low as they go: room for less than one more message */
+    KUNIT_ASSERT_EQ(test, resize_queue(queuep, 5 * footprint - 1), SUCCESS);
+    KUNIT_ASSERT_EQ(test, set_max_messages_count(queuep, 4), SUCCESS);
+    KUNIT_EXPECT_EQ(test, is_space_in_queue(queuep, TEST_MESSAGE_SIZE, NULL), 0);
+    struct message_queue_data* tmp_data = make_message(4);
+    KUNIT_ASSERT_NOT_NULL(test, tmp_data);
+    KUNIT_EXPECT_EQ(test, enqueue(queuep, tmp_data, 0, 0, 0, 0, 0, NULL), -EAGAIN);
+    KUNIT_EXPECT_EQ(test, begin_transaction(queuep, &transaction, NULL, 1, footprint), -EAGAIN);
+    KUNIT_EXPECT_EQ(test, begin_transaction(queuep, &transaction, NULL, 5, 5 * footprint), -EINVAL);
+    KUNIT_EXPECT_EQ(test, queuep->messages_count, 4UL);
+
+    /* One read makes room for exactly one more */
+    struct message_queue_data* read_data = dequeue(queuep);
+    KUNIT_ASSERT_NOT_NULL(test, read_data);
+    KUNIT_EXPECT_EQ(test, message_tag(read_data), 0U);
+    free_message_data(read_data);
+    KUNIT_EXPECT_EQ(test, enqueue(queuep, tmp_data, 0, 0, 0, 0, 0, NULL), SUCCESS);
+    KUNIT_EXPECT_EQ(test, is_space_in_queue(queuep, TEST_MESSAGE_SIZE, NULL), 0);
+
+    for(i = 1; i < 5; i++) {
+
+        read_data = dequeue(queuep);
+        KUNIT_ASSERT_NOT_NULL(test, read_data);
+        KUNIT_EXPECT_EQ(test, message_tag(read_data), i);
+        free_message_data(read_data);
+    }
+    KUNIT_EXPECT_EQ(test, queuep->messages_footprint, 0UL);
+}
+
+/* In ring mode a write to a queue at its limit evicts the oldest message instead */
+static void test_resize_ring(struct kunit* test) {
+
+    struct message_queue* queuep = test->priv;
+    unsigned int i;
+
+    queuep->mode = QUEUE_MODE_RING;
+    for(i = 0; i < 4; i++) {
+
+        struct message_queue_data* tmp_data = make_message(i);
+        KUNIT_ASSERT_NOT_NULL(test, tmp_data);
+        KUNIT_ASSERT_EQ(test, enqueue(queuep, tmp_data, 0, 0, 0, 0, 0, NULL), SUCCESS);
+    }
+    KUNIT_ASSERT_EQ(test, set_max_messages_count(queuep, 4), SUCCESS);
+
+    for(i = 4; i < 6; i++) {
+
+        struct message_queue_data* tmp_data = make_message(i);
+        KUNIT_ASSERT_NOT_NULL(test, tmp_data);
+        KUNIT_EXPECT_EQ(test, enqueue(queuep, tmp_data, 0, 0, 0, 0, 0, NULL), SUCCESS);
+    }
+    KUNIT_EXPECT_EQ(test, queuep->messages_count, 4UL);
+
+    /* The newest messages are the ones kept, still in order */
+    for(i = 2; i < 6; i++) {
+
+        struct message_queue_data* read_data = dequeue(queuep);
+        KUNIT_ASSERT_NOT_NULL(test, read_data);
+        KUNIT_EXPECT_EQ(test, message_tag(read_data), i);
+        free_message_data(read_data);
+    }
+}
+
+/* A message bigger than the quota of its producer or the queue is refused for good, not until a read */
+static void test_message_over_limits(struct kunit* test) {
+
+    struct message_queue* queuep = test->priv;
+    struct message_transaction transaction;
+    unsigned long footprint = message_footprint(TEST_MESSAGE_SIZE);
+
+    struct message_producer* producer = open_producer(queuep);
+    KUNIT_ASSERT_NOT_NULL(test, producer);
+    producer->quota = 1;
+    struct message_queue_data* tmp_data = make_message(0);
+    KUNIT_ASSERT_NOT_NULL(test, tmp_data);
+    KUNIT_EXPECT_EQ(test, is_space_in_queue(queuep, TEST_MESSAGE_SIZE, producer), -EMSGSIZE);
+    KUNIT_EXPECT_EQ(test, enqueue(queuep, tmp_data, 0, 0, 0, 0, 0, producer), -EMSGSIZE);
+    KUNIT_EXPECT_EQ(test, begin_transaction(queuep, &transaction, producer, 1, footprint), -EINVAL);
+
+    /* Other producers are not held to it */
+    KUNIT_EXPECT_EQ(test, enqueue(queuep, tmp_data, 0, 0, 0, 0, 0, NULL), SUCCESS);
+    close_producer(queuep, producer);
+
+    KUNIT_ASSERT_EQ(test, resize_queue(queuep, footprint + 1), SUCCESS);
+    KUNIT_EXPECT_EQ(test, is_space_in_queue(queuep, 2 * TEST_MESSAGE_SIZE, NULL), -EMSGSIZE);
+    KUNIT_EXPECT_EQ(test, is_space_in_queue(queuep, TEST_MESSAGE_SIZE, NULL), 0);
+}
+
+/* A call cannot be taken out of the log, which every log reader reads whole */
+static void test_call_refused_in_log(struct kunit* test) {
+
+    struct message_queue* queuep = test->priv;
+    unsigned int correlation_id;
+
+    struct message_queue_data* tmp_data = make_message(0);
+    KUNIT_ASSERT_NOT_NULL(test, tmp_data);
+    KUNIT_ASSERT_EQ(test, enqueue(queuep, tmp_data, 0, 0, 0, 0, 0, NULL), SUCCESS);
+
+    lock_queue(queuep, LOCK_SITE_IOCTL);
+    queuep->mode = QUEUE_MODE_LOG;
+    unlock_queue(queuep);
+    KUNIT_EXPECT_NULL(test, dequeue_call(queuep, &correlation_id));
+    KUNIT_EXPECT_EQ(test, queuep->messages_count, 1UL);
+
+    lock_queue(queuep, LOCK_SITE_IOCTL);
+    queuep->mode = QUEUE_MODE_FIFO;
+    unlock_queue(queuep);
+    tmp_data = dequeue_call(queuep, &correlation_id);
+    KUNIT_ASSERT_NOT_NULL(test, tmp_data);
+    KUNIT_EXPECT_EQ(test, correlation_id, 0U);
+    free_message_data(tmp_data);
+}
+
+/*
+ * A message dropped from the queue moves to its dead letter queue without
+ * counting as new traffic: it was counted once as it was written, and its
+ * read from the dead letters is not counted either.
+ */
+static void test_dead_letter_move(struct kunit* test) {
+
+    struct message_queue* queuep = test->priv;
+    struct message_queue_stats before;
+    struct message_queue_stats after;
+
+    struct message_queue* dead_letters = initialise_queue();
+    KUNIT_ASSERT_NOT_NULL(test, dead_letters);
+    dead_letters->holds_dead_letters = 1;
+    queuep->dead_letters = dead_letters;
+
+    struct message_queue_data* tmp_data = make_message(7);
+    KUNIT_ASSERT_NOT_NULL(test, tmp_data);
+    KUNIT_ASSERT_EQ(test, enqueue(queuep, tmp_data, 0, 0, 1, 0, 0, NULL), SUCCESS);
+    msleep(5);
+    collect_stats(queuep, &before);
+    KUNIT_EXPECT_EQ(test, reap_expired_messages(queuep), 1UL);
+    KUNIT_EXPECT_EQ(test, dead_letters->messages_count, 1UL);
+    KUNIT_EXPECT_NULL(test, dead_letters->cgroup_usage);
+
+    tmp_data = dequeue(dead_letters);
+    KUNIT_ASSERT_NOT_NULL(test, tmp_data);
+    KUNIT_EXPECT_EQ(test, message_tag(tmp_data), 7U);
+    free_message_data(tmp_data);
+    collect_stats(queuep, &after);
+    KUNIT_EXPECT_EQ(test, after.messages_enqueued, before.messages_enqueued);
+    KUNIT_EXPECT_EQ(test, after.messages_dequeued, before.messages_dequeued);
+    KUNIT_EXPECT_EQ(test, dead_letters->messages_footprint, 0UL);
+
+    queuep->dead_letters = NULL;
+    release_queue(dead_letters);
+}
+
+/* Runs the benchmark for TIMED_DURATION_MS and fails if an operation costs more than threshold_ns on average */
+static void check_op_cost(struct kunit* test, unsigned int threads, unsigned int threshold_ns) {
+
+    struct selfbench_result result;
+
+    if(threshold_ns == 0) {
+
+        kunit_skip(test, "no threshold set");
+    }
+
+    mutex_lock(&selfbench_lock);
+    int error = run_selfbench(threads, TIMED_DURATION_MS, TEST_MESSAGE_SIZE, &result);
+    mutex_unlock(&selfbench_lock);
+    KUNIT_ASSERT_EQ(test, error, 0);
+    KUNIT_ASSERT_GT(test, result.operations, 0ULL);
+
+    unsigned long long op_ns = div64_u64(result.enqueue_ns + result.dequeue_ns, result.operations);
+    kunit_info(test, "%u threads: %llu operations, %llu ns each, %llu lock contentions\n",
+               threads, result.operations, op_ns, result.lock_contentions);
+    KUNIT_EXPECT_LE_MSG(test, op_ns, (unsigned long long) threshold_ns, "enqueue and dequeue got slower");
+}
+
+static void test_op_cost(struct kunit* test) {
+
+    check_op_cost(test, 1, max_op_ns);
+}
+
+static void test_contended_op_cost(struct kunit* test) {
+
+    check_op_cost(test, TIMED_THREADS, max_contended_op_ns);
+}
+
+static struct kunit_case message_queue_test_cases[] = {
+    KUNIT_CASE(test_fifo_order),
+    KUNIT_CASE(test_capacity_race),
+    KUNIT_CASE(test_resize_below_usage),
+    KUNIT_CASE(test_resize_ring),
+    KUNIT_CASE(test_message_over_limits),
+    KUNIT_CASE(test_call_refused_in_log),
+    KUNIT_CASE(test_dead_letter_move),
+    KUNIT_CASE_SLOW(test_op_cost),
+    KUNIT_CASE_SLOW(test_contended_op_cost),
+    {}
+};
+
+static struct kunit_suite message_queue_test_suite = {
+    .name = "opsysmem_message_queue",
+    .init = init_queue_test,
+    .exit = exit_queue_test,
+    .test_cases = message_queue_test_cases,
+};
+kunit_test_suite(message_queue_test_suite);